@@ -0,0 +1,243 @@
+#!/usr/bin/env python
+"""Compile-throughput and code-growth benchmark for the obfuscation passes.
+
+Every C/C++ source of the corpus is compiled at -O2 without any pass, then
+once with each pass loaded. For each run the compiler wall time, the time
+spent in the pass (from -time-passes), the number of IR instructions and the
+object size are recorded in a JSON report.
+
+The corpus is made of directories, source files and source tarballs
+(.tar.gz, .tgz, .tar.bz2, .tar.xz) which are unpacked locally: nothing is
+downloaded, so the benchmark runs on air-gapped machines.
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tarfile
+import time
+
+SOURCE_SUFFIXES = ('.c', '.cc', '.cpp')
+TARBALL_SUFFIXES = ('.tar.gz', '.tgz', '.tar.bz2', '.tar.xz')
+
+# Pass descriptions, as printed by -time-passes
+PASS_DESCRIPTIONS = {
+    'ObfuscateZero': 'Obfuscates zeroes',
+    'X-OR': 'Obfuscates XORs',
+    'SplitBitwiseOp': 'Splits bitwise operators',
+}
+
+TIMING_RE = re.compile(r'([0-9.]+) \(\s*[0-9.]+%\)')
+INSTRUCTION_RE = re.compile(r'^\s+(%\S+ = )?[a-z]')
+
+
+def collect_sources(corpus, work_dir):
+    """Returns (source, include directories) pairs for every corpus entry."""
+    sources = []
+    for entry in corpus:
+        entry = os.path.abspath(entry)
+        if entry.endswith(TARBALL_SUFFIXES):
+            name = os.path.basename(entry)
+            for suffix in TARBALL_SUFFIXES:
+                if name.endswith(suffix):
+                    name = name[:-len(suffix)]
+            dest = os.path.join(work_dir, 'corpus', name)
+            if not os.path.isdir(dest):
+                with tarfile.open(entry) as tar:
+                    tar.extractall(dest)
+            entry = dest
+        if os.path.isfile(entry):
+            if entry.endswith(SOURCE_SUFFIXES):
+                sources.append((entry, [os.path.dirname(entry)]))
+            continue
+        for root, dirs, files in os.walk(entry):
+            dirs.sort()
+            for name in sorted(files):
+                if name.endswith(SOURCE_SUFFIXES):
+                    sources.append((os.path.join(root, name), [root, entry]))
+    return sources
+
+
+def compiler_for(source, llvm_root):
+    name = 'clang' if source.endswith('.c') else 'clang++'
+    return os.path.join(llvm_root, 'bin', name)
+
+
+def run(command):
+    start = time.time()
+    process = subprocess.Popen(command, stdout=subprocess.PIPE,
+                               stderr=subprocess.PIPE)
+    out, err = process.communicate()
+    elapsed = time.time() - start
+    if process.returncode != 0:
+        raise RuntimeError('{} failed:\n{}'.format(' '.join(command),
+                                                   err.decode('utf-8', 'replace')))
+    return elapsed, err.decode('utf-8', 'replace')
+
+
+def pass_time(timing_report, description):
+    """Sums the wall time of every -time-passes line for the given pass."""
+    total = 0.
+    for line in timing_report.splitlines():
+        if not line.rstrip().endswith(description):
+            continue
+        timings = TIMING_RE.findall(line)
+        if timings:
+            total += float(timings[-1])
+    return total
+
+
+def count_instructions(ir_file):
+    count = 0
+    in_function = False
+    with open(ir_file) as ir:
+        for line in ir:
+            if line.startswith('define '):
+                in_function = True
+            elif line.startswith('}'):
+                in_function = False
+            elif in_function and INSTRUCTION_RE.match(line):
+                count += 1
+    return count
+
+
+def measure(source, includes, pass_name, args):
+    """Compiles source with the given pass (None for the baseline)."""
+    base = os.path.join(args.work_dir, 'out',
+                        re.sub(r'[^A-Za-z0-9_.]', '_',
+                               os.path.relpath(source, '/')))
+    tag = pass_name or 'baseline'
+    obj, ir = '{}.{}.o'.format(base, tag), '{}.{}.ll'.format(base, tag)
+    if not os.path.isdir(os.path.dirname(obj)):
+        os.makedirs(os.path.dirname(obj))
+
+    command = [compiler_for(source, args.llvm_root), '-O2', '-w']
+    command += ['-I' + include for include in includes]
+    command += args.cflags
+    if pass_name:
+        module = os.path.join(args.passes_dir,
+                              'LLVM{}.so'.format(pass_name))
+        command += ['-Xclang', '-load', '-Xclang', module]
+
+    wall_times, pass_times = [], []
+    for _ in range(args.repeat):
+        elapsed, report = run(command + ['-mllvm', '-time-passes',
+                                         '-c', source, '-o', obj])
+        wall_times.append(elapsed)
+        if pass_name:
+            pass_times.append(pass_time(report,
+                                        PASS_DESCRIPTIONS.get(pass_name,
+                                                              pass_name)))
+    run(command + ['-S', '-emit-llvm', source, '-o', ir])
+
+    result = {
+        'wall_time': min(wall_times),
+        'ir_instructions': count_instructions(ir),
+        'object_size': os.path.getsize(obj),
+    }
+    if pass_name:
+        result['pass_time'] = min(pass_times)
+    return result
+
+
+def geomean(values):
+    values = [v for v in values if v > 0]
+    if not values:
+        return 0.
+    return math.exp(sum(math.log(v) for v in values) / len(values))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('passes', nargs='+',
+                        help='passes to benchmark, e.g. X-OR')
+    parser.add_argument('--llvm-root', required=True)
+    parser.add_argument('--passes-dir', required=True,
+                        help='directory of the LLVM<pass>.so modules')
+    parser.add_argument('--corpus', action='append', required=True,
+                        help='source directory, file or tarball')
+    parser.add_argument('--work-dir', default='bench_work')
+    parser.add_argument('--output', default='bench_report.json')
+    parser.add_argument('--repeat', type=int, default=1,
+                        help='compilations per measure, the fastest is kept')
+    parser.add_argument('--cflags', default='',
+                        help='extra compiler flags')
+    args = parser.parse_args()
+    args.cflags = args.cflags.split()
+    args.work_dir = os.path.abspath(args.work_dir)
+
+    sources = collect_sources(args.corpus, args.work_dir)
+    if not sources:
+        sys.exit('bench: empty corpus')
+
+    files, failures = [], []
+    for source, includes in sources:
+        entry = {'source': source}
+        try:
+            baseline = measure(source, includes, None, args)
+        except RuntimeError as error:
+            failures.append({'source': source, 'pass': None,
+                             'error': str(error)})
+            continue
+        entry['baseline'] = baseline
+        for pass_name in args.passes:
+            try:
+                result = measure(source, includes, pass_name, args)
+            except RuntimeError as error:
+                failures.append({'source': source, 'pass': pass_name,
+                                 'error': str(error)})
+                continue
+            result['ir_growth'] = (float(result['ir_instructions']) /
+                                   max(baseline['ir_instructions'], 1))
+            result['object_growth'] = (float(result['object_size']) /
+                                       max(baseline['object_size'], 1))
+            result['compile_time_ratio'] = (result['wall_time'] /
+                                            max(baseline['wall_time'], 1e-9))
+            entry[pass_name] = result
+        files.append(entry)
+        print('bench: {}'.format(source), file=sys.stderr)
+
+    summary = {'baseline': {
+        'wall_time': sum(f['baseline']['wall_time'] for f in files),
+        'ir_instructions': sum(f['baseline']['ir_instructions']
+                               for f in files),
+        'object_size': sum(f['baseline']['object_size'] for f in files),
+    }}
+    for pass_name in args.passes:
+        results = [f[pass_name] for f in files if pass_name in f]
+        summary[pass_name] = {
+            'files': len(results),
+            'wall_time': sum(r['wall_time'] for r in results),
+            'pass_time': sum(r['pass_time'] for r in results),
+            'ir_instructions': sum(r['ir_instructions'] for r in results),
+            'object_size': sum(r['object_size'] for r in results),
+            'geomean_ir_growth': geomean([r['ir_growth'] for r in results]),
+            'geomean_object_growth': geomean([r['object_growth']
+                                              for r in results]),
+            'geomean_compile_time_ratio': geomean([r['compile_time_ratio']
+                                                   for r in results]),
+        }
+
+    report = {
+        'llvm_root': args.llvm_root,
+        'passes': args.passes,
+        'cflags': args.cflags,
+        'repeat': args.repeat,
+        'summary': summary,
+        'files': files,
+        'failures': failures,
+    }
+    with open(args.output, 'w') as output:
+        json.dump(report, output, indent=2, sort_keys=True)
+    print('bench: report written to {}'.format(args.output), file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -10,6 +10,13 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
+
 #ifndef NDEBUG
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/Debug.h"
@@ -18,8 +25,68 @@
 #include <vector>
 #include <random>
 
+#include "../ObfuscationUtils/Budget.hpp"
+#include "../ObfuscationUtils/Hotness.hpp"
+#include "../ObfuscationUtils/Pipeline.hpp"
+#include "../ObfuscationUtils/Random.hpp"
+#include "../ObfuscationUtils/Selection.hpp"
+#include "../ObfuscationUtils/Timers.hpp"
+
 using namespace llvm;
 
+#define DEBUG_TYPE "obfuscate-zero"
+
+STATISTIC(NumZerosReplaced, "Number of zero operands replaced");
+STATISTIC(NumZerosKept, "Number of zero operands which could not be replaced");
+STATISTIC(NumHotZerosKept, "Number of zero operands of hot blocks left as is");
+STATISTIC(NumTooDeep, "Number of zero operands kept to bound the latency added");
+STATISTIC(NumPoolPredicates, "Number of opaque zeros built for a shared pool");
+STATISTIC(NumPoolReuses, "Number of zero operands replaced by a shared one");
+STATISTIC(NumOverBudget, "Number of zero operands kept within the budget");
+STATISTIC(NumUnselected, "Number of functions left out by the selection");
+STATISTIC(NumInstructionsEmitted, "Number of instructions emitted");
+
+static cl::opt<unsigned> HotReplaceRatio(
+    "zero-hot-ratio",
+    cl::desc("Percentage of the zero operands of hot blocks which are "
+             "replaced (see -obf-hot-threshold)"),
+    cl::init(25));
+
+static cl::opt<unsigned> MaxAddedLatency(
+    "zero-max-added-latency",
+    cl::desc("Maximum latency, in estimated cycles, that an opaque zero may "
+             "add to the dependency chain of the instruction using it"),
+    cl::init(16));
+
+enum PoolScope { BlockPool, FunctionPool };
+
+static cl::opt<unsigned> PoolSize(
+    "zero-pool-size",
+    cl::desc("Number of opaque zeros shared by the zero operands of a block "
+             "or function (0 builds an opaque zero per operand)"),
+    cl::init(0));
+
+static cl::opt<PoolScope> PoolScopeOpt(
+    "zero-pool-scope", cl::desc("Scope of the shared opaque zeros"),
+    cl::values(clEnumValN(BlockPool, "block", "Pool built in each block"),
+               clEnumValN(FunctionPool, "function",
+                          "Pool built in the entry block from the integer "
+                          "arguments of the function"),
+               clEnumValEnd),
+    cl::init(BlockPool));
+
+static cl::opt<unsigned> PoolRatio(
+    "zero-pool-ratio",
+    cl::desc("Percentage of the zero operands replaced by a shared opaque "
+             "zero, the others getting their own (see -zero-pool-size)"),
+    cl::init(100));
+
+static cl::opt<bool> PoolMix(
+    "zero-pool-mix",
+    cl::desc("Combine each shared opaque zero with a cheap per-operand "
+             "operation to diversify the sites"),
+    cl::init(false));
+
 namespace {
   using prime_type = uint32_t;
 
@@ -42,20 +109,125 @@ static const prime_type Prime_array[] = {
     877,   881,   883,   887,   907,    911,    919,    929,    937,    941,
     947,   953,   967,   971,   977,    983,    991,    997};
 
-class ObfuscateZero : public BasicBlockPass {
+// Estimated latency of an instruction, in cycles
+unsigned latency(Instruction const &Inst) {
+  switch (Inst.getOpcode()) {
+  case Instruction::PHI:
+    return 0;
+  case Instruction::Mul:
+    return 3;
+  case Instruction::Load:
+    return 4;
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+    return 20;
+  default:
+    return 1;
+  }
+}
+
+// Latency of the opaque predicate built by replaceZero, from its operands to
+// its result: zext/trunc, and, or, two muls, icmp and zext. Both halves of
+// the predicate are independent, so only one of them is on the critical path.
+static const unsigned PredicateLatency = 1 + 1 + 1 + 3 + 3 + 1 + 1;
+
+class ObfuscateZero : public FunctionPass {
+  // Integers available as predicate operands: function arguments and the
+  // original instructions of the block, never the ones created by the pass,
+  // so that opaque predicates do not nest.
   std::vector<Value *> IntegerVect;
+  // Critical path from the block entry to the result of each instruction of
+  // the block, in estimated cycles (values absent are available at entry).
+  DenseMap<Value const *, unsigned> Depths;
+  Value *Shallowest = nullptr;
+  // Shared opaque zeros (i1 false), see -zero-pool-size
+  std::vector<Value *> ZeroPool;
+  BasicBlock *CurrentBlock = nullptr;
   std::default_random_engine Generator;
+  ObfuscationUtils::Hotness Hotness;
+  ObfuscationUtils::Budget Budget;
+  // Estimated cost of the instructions built for the current zero operand,
+  // only tracked with an overhead budget
+  ObfuscationUtils::Cost SiteCost;
+  ObfuscationUtils::Selection Selection;
 
 public:
 
   static char ID;
 
-  ObfuscateZero() : BasicBlockPass(ID) {}
+  ObfuscateZero() : FunctionPass(ID), Selection("zero") {}
+
+  bool doInitialization(Module &M) override {
+    Selection.reset(M);
+    return false;
+  }
+
+  bool doFinalization(Module &M) override {
+    return ObfuscationUtils::Budget::finalize(M);
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    if (ObfuscationUtils::Hotness::enabled())
+      AU.addRequired<BlockFrequencyInfo>();
+    if (ObfuscationUtils::Budget::enabled())
+      AU.addRequired<TargetTransformInfo>();
+    AU.setPreservesCFG();
+  }
+
+  bool runOnFunction(Function &F) override {
+    if (!Selection.isSelected(F)) {
+      ++NumUnselected;
+      return false;
+    }
+
+    bool modified = false;
+    size_t SizeBefore = 0;
+    for (auto const &BB : F)
+      SizeBefore += BB.size();
+    ZeroPool.clear();
+    ObfuscationUtils::seedGenerator(Generator, DEBUG_TYPE, F);
+
+    Hotness.reset(ObfuscationUtils::Hotness::enabled()
+                      ? &getAnalysis<BlockFrequencyInfo>()
+                      : nullptr,
+                  F);
+    Budget.reset(ObfuscationUtils::Budget::enabled()
+                     ? &getAnalysis<TargetTransformInfo>()
+                     : nullptr,
+                 *F.getParent());
+
+    for (auto &BB : F)
+      modified |= runOnBasicBlock(BB);
+
+    for (auto const &BB : F)
+      NumInstructionsEmitted += BB.size();
+    NumInstructionsEmitted -= SizeBefore;
+
+#ifndef NDEBUG
+    verifyFunction(F);
+#endif
+    return modified;
+  }
 
-  bool runOnBasicBlock(BasicBlock &BB) override {
+  bool runOnBasicBlock(BasicBlock &BB) {
+    CurrentBlock = &BB;
     IntegerVect.clear();
+    Depths.clear();
+    Shallowest = nullptr;
+    if (PoolScopeOpt == BlockPool)
+      ZeroPool.clear();
+    for (auto &Arg : BB.getParent()->getArgumentList())
+      registerInteger(Arg);
     bool modified = false;
 
+    // Only some zeroes of hot blocks are replaced, if any
+    const bool Hot = Hotness.isHot(BB);
+    if (Hot and ObfuscationUtils::SkipHot)
+      return false;
+    std::uniform_int_distribution<unsigned> Percent(0, 99);
+
     // Not iterating from the beginning to avoid obfuscation of Phi instructions
     // parameters
     for (typename BasicBlock::iterator I = BB.getFirstInsertionPt(),
@@ -65,21 +237,33 @@ public:
       if (isValidCandidateInstruction(Inst)) {
         for (size_t i = 0; i < Inst.getNumOperands(); ++i) {
           if (Constant *C = isValidCandidateOperand(Inst.getOperand(i))) {
+            if (Hot and Percent(Generator) >= HotReplaceRatio) {
+              ++NumHotZerosKept;
+              continue;
+            }
+            // Zero operands all cost about the same, they are taken in
+            // order as long as an opaque predicate of their own fits
+            SiteCost = ObfuscationUtils::Cost();
+            if (!predicateFits(C->getType(), 1)) {
+              ++NumOverBudget;
+              continue;
+            }
             if (Value *New_val = replaceZero(Inst, C)) {
               Inst.setOperand(i, New_val);
               modified = true;
+              ++NumZerosReplaced;
             } else {
               //dbgs() << "ObfuscateZero: could not rand pick a variable for replacement\n";
+              ++NumZerosKept;
             }
+            if (ObfuscationUtils::Budget::enabled())
+              Budget.spend(SiteCost);
           }
         }
       }
+      Depths[&Inst] = readyTime(Inst) + latency(Inst);
       registerInteger(Inst);
     }
-
-#ifndef NDEBUG
-    verifyFunction(*BB.getParent());
-#endif
     return modified;
   }
 
@@ -112,14 +296,39 @@ private:
   }
 
   void registerInteger(Value &V) {
-    if (V.getType()->isIntegerTy())
-      IntegerVect.push_back(&V);
+    if (!V.getType()->isIntegerTy())
+      return;
+    IntegerVect.push_back(&V);
+    if (!Shallowest || depthOf(&V) < depthOf(Shallowest))
+      Shallowest = &V;
+  }
+
+  unsigned depthOf(Value const *V) const { return Depths.lookup(V); }
+
+  // Cycle at which every operand of Inst is available
+  unsigned readyTime(Instruction const &Inst) const {
+    unsigned Ready = 0;
+    for (auto const &Op : Inst.operands())
+      Ready = std::max(Ready, depthOf(Op));
+    return Ready;
+  }
+
+  // Randomly picks a registered integer available before cycle MaxDepth.
+  // Random tries are bounded, the shallowest integer being the fallback.
+  Value *pickOperand(unsigned MaxDepth) {
+    std::uniform_int_distribution<size_t> Rand(0, IntegerVect.size() - 1);
+    for (unsigned Try = 0; Try < 8; ++Try) {
+      Value *V = IntegerVect[Rand(Generator)];
+      if (depthOf(V) <= MaxDepth)
+        return V;
+    }
+    return depthOf(Shallowest) <= MaxDepth ? Shallowest : nullptr;
   }
 
   // Return a random prime number not equal to DifferentFrom
   // If an error occurs returns 0
   prime_type getPrime(prime_type DifferentFrom = 0) {
-      static std::uniform_int_distribution<prime_type> Rand(0, std::extent<decltype(Prime_array)>::value);
+      std::uniform_int_distribution<size_t> Rand(0, std::extent<decltype(Prime_array)>::value - 1);
       size_t MaxLoop = 10;
       prime_type Prime;
 
@@ -134,29 +343,59 @@ private:
       return Prime;
   }
 
-  Value *replaceZero(Instruction &Inst, Value *VReplace) {
-    // Replacing 0 by:
-    // prime1 * ((x | any1)**2) != prime2 * ((y | any2)**2)
-    // with prime1 != prime2 and any1 != 0 and any2 != 0
+  // Maximum depth of the operands of an opaque zero used by Inst, so that it
+  // does not delay Inst by more than MaxAddedLatency cycles. Cost is the
+  // latency of the instructions between these operands and Inst.
+  bool maxOperandDepth(Instruction &Inst, unsigned Cost, unsigned &MaxDepth) {
+    const unsigned Ready = readyTime(Inst);
+    if (Ready + MaxAddedLatency < Cost)
+      return false;
+    MaxDepth = Ready + MaxAddedLatency - Cost;
+    return true;
+  }
+
+  // Accounts for instructions built for the current zero operand
+  void addCost(unsigned Opcode, Type *Ty, unsigned Count = 1) {
+    if (ObfuscationUtils::Budget::enabled())
+      SiteCost += Budget.operation(Opcode, Ty, Count);
+  }
+
+  // Whether one more opaque predicate fits in the budget, along with what
+  // was built for the current zero operand and the Extensions operations
+  // turning a predicate into a ReplacedType operand
+  bool predicateFits(Type *ReplacedType, unsigned Extensions) const {
+    return !ObfuscationUtils::Budget::enabled() ||
+           Budget.fits(SiteCost + predicateCost(ReplacedType->getContext()) +
+                       Budget.operation(Instruction::ZExt, ReplacedType,
+                                        Extensions));
+  }
+
+  // Estimated cost of an opaque predicate, see buildPredicate
+  ObfuscationUtils::Cost predicateCost(LLVMContext &Context) const {
+    Type *IntermediaryType = IntegerType::get(Context, sizeof(prime_type) * 8);
+    ObfuscationUtils::Cost Estimate =
+        Budget.operation(Instruction::ZExt, IntermediaryType, 2);
+    Estimate += Budget.operation(Instruction::And, IntermediaryType, 2);
+    Estimate += Budget.operation(Instruction::Or, IntermediaryType, 2);
+    Estimate += Budget.operation(Instruction::Mul, IntermediaryType, 4);
+    Estimate += Budget.operation(Instruction::ICmp, IntermediaryType);
+    return Estimate;
+  }
+
+  // Builds before InsertPt an i1 opaque predicate, always false:
+  // prime1 * ((x | any1)**2) == prime2 * ((y | any2)**2)
+  // with prime1 != prime2 and any1 != 0 and any2 != 0
+  Value *buildPredicate(Instruction *InsertPt, Value *Lhs, Value *Rhs) {
     prime_type p1 = getPrime(),
                p2 = getPrime(p1);
 
     if(p2 == 0 || p1 == 0)
         return nullptr;
 
-    Type *ReplacedType = VReplace->getType(),
-         *IntermediaryType = IntegerType::get(Inst.getParent()->getContext(),
+    Type *IntermediaryType = IntegerType::get(InsertPt->getContext(),
                                               sizeof(prime_type) * 8);
-
-    if (IntegerVect.empty()) {
-      return nullptr;
-    }
-
-    std::uniform_int_distribution<size_t> Rand(0, IntegerVect.size() - 1);
     std::uniform_int_distribution<size_t> RandAny(1, 10);
 
-    size_t Index1 = Rand(Generator), Index2 = Rand(Generator);
-
     // Getting the literals as LLVM objects
     Constant *any1 = ConstantInt::get(IntermediaryType, 1 + RandAny(Generator)),
              *any2 = ConstantInt::get(IntermediaryType, 1 + RandAny(Generator)),
@@ -165,41 +404,154 @@ private:
              // Bitmask to prevent overflow
              *OverflowMask = ConstantInt::get(IntermediaryType, 0x00000007);
 
-    IRBuilder<> Builder(&Inst);
+    IRBuilder<> Builder(InsertPt);
 
     // lhs
     // To avoid overflow
-    Value *LhsCast =
-        Builder.CreateZExtOrTrunc(IntegerVect.at(Index1), IntermediaryType);
-    registerInteger(*LhsCast);
+    Value *LhsCast = Builder.CreateZExtOrTrunc(Lhs, IntermediaryType);
     Value *LhsAnd = Builder.CreateAnd(LhsCast, OverflowMask);
-    registerInteger(*LhsAnd);
     Value *LhsOr = Builder.CreateOr(LhsAnd, any1);
-    registerInteger(*LhsOr);
     Value *LhsSquare = Builder.CreateMul(LhsOr, LhsOr);
-    registerInteger(*LhsSquare);
     Value *LhsTot = Builder.CreateMul(LhsSquare, prime1);
-    registerInteger(*LhsTot);
 
     // rhs
-    Value *RhsCast =
-        Builder.CreateZExtOrTrunc(IntegerVect.at(Index2), IntermediaryType);
-    registerInteger(*RhsCast);
+    Value *RhsCast = Builder.CreateZExtOrTrunc(Rhs, IntermediaryType);
     Value *RhsAnd = Builder.CreateAnd(RhsCast, OverflowMask);
-    registerInteger(*RhsAnd);
     Value *RhsOr = Builder.CreateOr(RhsAnd, any2);
-    registerInteger(*RhsOr);
     Value *RhsSquare = Builder.CreateMul(RhsOr, RhsOr);
-    registerInteger(*RhsSquare);
     Value *RhsTot = Builder.CreateMul(RhsSquare, prime2);
-    registerInteger(*RhsTot);
 
     // comp
     Value *comp =
         Builder.CreateICmp(CmpInst::Predicate::ICMP_EQ, LhsTot, RhsTot);
-    registerInteger(*comp);
+    if (InsertPt->getParent() == CurrentBlock)
+      Depths[comp] =
+          std::max(depthOf(Lhs), depthOf(Rhs)) + PredicateLatency - 1;
+    if (ObfuscationUtils::Budget::enabled())
+      SiteCost += predicateCost(InsertPt->getContext());
+    return comp;
+  }
+
+  // Builds an opaque predicate for Inst only
+  Value *newPredicate(Instruction &Inst) {
+    unsigned MaxDepth;
+    if (!maxOperandDepth(Inst, PredicateLatency, MaxDepth)) {
+      ++NumTooDeep;
+      return nullptr;
+    }
+    Value *Lhs = pickOperand(MaxDepth), *Rhs = pickOperand(MaxDepth);
+    if (!Lhs || !Rhs) {
+      ++NumTooDeep;
+      return nullptr;
+    }
+    return buildPredicate(&Inst, Lhs, Rhs);
+  }
+
+  // Fills the pool of shared opaque zeros, before Inst for a block pool and
+  // at the top of the entry block, from the arguments, for a function pool.
+  // The operand of Inst being replaced is charged for the whole pool: it
+  // only gets the predicates which fit in the budget.
+  void fillPool(Instruction &Inst, Type *ReplacedType) {
+    Function &F = *Inst.getParent()->getParent();
+    const unsigned Extensions = PoolMix ? 2 : 1;
+    if (PoolScopeOpt == BlockPool) {
+      for (unsigned I = 0; I < PoolSize; ++I) {
+        if (!predicateFits(ReplacedType, Extensions))
+          break;
+        if (Value *Zero = newPredicate(Inst))
+          ZeroPool.push_back(Zero);
+      }
+    } else {
+      std::vector<Value *> Arguments;
+      for (auto &Arg : F.getArgumentList())
+        if (Arg.getType()->isIntegerTy())
+          Arguments.push_back(&Arg);
+      if (Arguments.empty())
+        return;
+      std::uniform_int_distribution<size_t> Rand(0, Arguments.size() - 1);
+      Instruction *InsertPt = F.getEntryBlock().getFirstInsertionPt();
+      for (unsigned I = 0; I < PoolSize; ++I) {
+        if (!predicateFits(ReplacedType, Extensions))
+          break;
+        if (Value *Zero = buildPredicate(InsertPt, Arguments[Rand(Generator)],
+                                         Arguments[Rand(Generator)]))
+          ZeroPool.push_back(Zero);
+      }
+    }
+    NumPoolPredicates += ZeroPool.size();
+  }
+
+  // Picks a shared opaque zero for Inst, or returns nullptr if none is
+  // available early enough
+  Value *pickPooled(Instruction &Inst, unsigned Cost) {
+    unsigned MaxDepth;
+    if (ZeroPool.empty() || !maxOperandDepth(Inst, Cost, MaxDepth))
+      return nullptr;
+    std::uniform_int_distribution<size_t> Rand(0, ZeroPool.size() - 1);
+    Value *Zero = ZeroPool[Rand(Generator)];
+    return depthOf(Zero) <= MaxDepth ? Zero : nullptr;
+  }
+
+  // Makes a shared opaque zero specific to a site with a cheap operation
+  Value *mixPooled(IRBuilder<> &Builder, Value *Zero, Type *ReplacedType) {
+    std::uniform_int_distribution<unsigned> RandMix(0, 2);
+    switch (RandMix(Generator)) {
+    case 0: {
+      // or with another shared zero, available as early
+      std::uniform_int_distribution<size_t> Rand(0, ZeroPool.size() - 1);
+      Value *Other = ZeroPool[Rand(Generator)];
+      if (depthOf(Other) > depthOf(Zero))
+        Other = Zero;
+      return Builder.CreateZExt(Builder.CreateOr(Zero, Other), ReplacedType);
+    }
+    case 1: {
+      // shift by a random amount
+      const unsigned Width = ReplacedType->getIntegerBitWidth();
+      std::uniform_int_distribution<unsigned> Rand(0, Width - 1);
+      return Builder.CreateShl(Builder.CreateZExt(Zero, ReplacedType),
+                               Rand(Generator));
+    }
+    default:
+      // multiply by a random odd constant
+      return Builder.CreateMul(
+          Builder.CreateZExt(Zero, ReplacedType),
+          ConstantInt::get(ReplacedType, 2 * Generator() + 1));
+    }
+  }
+
+  Value *replaceZero(Instruction &Inst, Value *VReplace) {
+    NamedRegionTimer Timer(DEBUG_TYPE " replaceZero",
+                           ObfuscationUtils::TimerGroupName,
+                           TimePassesIsEnabled);
+    if (IntegerVect.empty()) {
+      return nullptr;
+    }
+
+    Type *ReplacedType = VReplace->getType();
+    IRBuilder<> Builder(&Inst);
+
+    // Shared opaque zeros, extended and possibly mixed
+    std::uniform_int_distribution<unsigned> Percent(0, 99);
+    if (PoolSize && Percent(Generator) < PoolRatio) {
+      if (ZeroPool.empty())
+        fillPool(Inst, ReplacedType);
+      const unsigned Cost = PoolMix ? 2 : 1;
+      if (Value *Zero = pickPooled(Inst, Cost)) {
+        ++NumPoolReuses;
+        Value *Shared = PoolMix ? mixPooled(Builder, Zero, ReplacedType)
+                                : Builder.CreateZExt(Zero, ReplacedType);
+        addCost(Instruction::ZExt, ReplacedType, Cost);
+        Depths[Shared] = depthOf(Zero) + Cost;
+        return Shared;
+      }
+    }
+
+    Value *comp = newPredicate(Inst);
+    if (!comp)
+      return nullptr;
     Value *castComp = Builder.CreateZExt(comp, ReplacedType);
-    registerInteger(*castComp);
+    Depths[castComp] = depthOf(comp) + 1;
+    addCost(Instruction::ZExt, ReplacedType);
 
     return castComp;
   }
@@ -210,11 +562,6 @@ char ObfuscateZero::ID = 0;
 static RegisterPass<ObfuscateZero> X("ObfuscateZero", "Obfuscates zeroes",
                                      false, false);
 
-// register pass for clang use
-static void registerObfuscateZeroPass(const PassManagerBuilder &,
-                                      PassManagerBase &PM) {
-  PM.add(new ObfuscateZero());
-}
-static RegisterStandardPasses
-    RegisterMBAPass(PassManagerBuilder::EP_EarlyAsPossible,
-                    registerObfuscateZeroPass);
+// register pass for clang use, see -obf-placement
+static ObfuscationUtils::RegisterStandardObfuscation<ObfuscateZero>
+    RegisterMBAPass;
@@ -0,0 +1,192 @@
+#ifndef __BUDGET_HPP__
+#define __BUDGET_HPP__
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "SharedOptions.hpp"
+
+using namespace llvm;
+
+namespace ObfuscationUtils {
+
+// Named metadata holding the accounts of a module, see Budget
+static const char BudgetMetadataName[] = "obf.budget";
+
+static cl::opt<unsigned> &CycleBudget = getSharedOption<cl::opt<unsigned>>(
+    "obf-cycle-budget",
+    cl::desc("Estimated cycles the obfuscation passes may add to a module, in "
+             "percent of its original estimate (0 for no limit)"),
+    cl::init(0));
+
+static cl::opt<unsigned> &SizeBudget = getSharedOption<cl::opt<unsigned>>(
+    "obf-size-budget",
+    cl::desc("Instructions the obfuscation passes may add to a module, in "
+             "percent of its original size: 100 allows doubling it (0 for no "
+             "limit)"),
+    cl::init(0));
+
+// Estimated cycles and size, in TargetTransformInfo cost units and
+// instructions. Estimates are static: every instruction counts once,
+// whatever the frequency of its block.
+struct Cost {
+    uint64_t Cycles, Size;
+
+    Cost(uint64_t Cycles = 0, uint64_t Size = 0)
+        : Cycles(Cycles), Size(Size) {}
+
+    Cost &operator+=(Cost const &Other) {
+        Cycles += Other.Cycles;
+        Size += Other.Size;
+        return *this;
+    }
+    Cost operator+(Cost const &Other) const {
+        return Cost(Cycles + Other.Cycles, Size + Other.Size);
+    }
+    Cost operator*(unsigned Count) const {
+        return Cost(Cycles * Count, Size * Count);
+    }
+};
+
+// Transformation the passes may or may not apply: a tree, a zero operand...
+// Value is the number of operations it obfuscates.
+struct Candidate {
+    Cost Estimate;
+    unsigned Value;
+};
+
+// Overhead budget of a module, shared by every obfuscation pass run on it,
+// whichever module they were built in: the estimate of the original module
+// and what the passes spent so far are kept in its metadata. Under
+// llvm-obfuscate, each partition is such a module, with its own budget.
+class Budget {
+    TargetTransformInfo const *TTI = nullptr;
+    Module *M = nullptr;
+    Cost Baseline, Spent;
+
+  public:
+    // The passes only require TargetTransformInfo when this is true
+    static bool enabled() { return CycleBudget != 0 or SizeBudget != 0; }
+
+    // To be called before each function. The first pass run on the module
+    // estimates it, before anything is transformed.
+    void reset(TargetTransformInfo const *NewTTI, Module &NewM) {
+        TTI = NewTTI;
+        M = &NewM;
+        if (not enabled())
+            return;
+        NamedMDNode *Accounts = M->getNamedMetadata(BudgetMetadataName);
+        if (Accounts and Accounts->getNumOperands()) {
+            MDNode *Node = Accounts->getOperand(0);
+            auto Field = [Node](unsigned I) {
+                return cast<ConstantInt>(Node->getOperand(I))->getZExtValue();
+            };
+            Baseline = Cost(Field(0), Field(1));
+            Spent = Cost(Field(2), Field(3));
+            return;
+        }
+        Baseline = Spent = Cost();
+        for (auto const &F : *M)
+            for (auto const &BB : F)
+                for (auto const &I : BB)
+                    Baseline += instruction(I);
+        save();
+    }
+
+    // Removes the accounts from M once every pass is done with it, so that
+    // they don't end up in the output: to be called from doFinalization
+    static bool finalize(Module &M) {
+        NamedMDNode *Accounts = M.getNamedMetadata(BudgetMetadataName);
+        if (not Accounts)
+            return false;
+        M.eraseNamedMetadata(Accounts);
+        return true;
+    }
+
+    // Estimated cost of an instruction of the module
+    Cost instruction(Instruction const &I) const {
+        const unsigned Cycles = TTI->getUserCost(&I);
+        return Cost(Cycles, Cycles != TargetTransformInfo::TCC_Free);
+    }
+
+    // Estimated cost of Count instructions to create
+    Cost operation(unsigned Opcode, Type *Ty, unsigned Count = 1) const {
+        const unsigned Cycles = TTI->getOperationCost(Opcode, Ty);
+        return Cost(Cycles, Cycles != TargetTransformInfo::TCC_Free) * Count;
+    }
+
+    bool fits(Cost const &C) const {
+        return (not CycleBudget or
+                (Spent.Cycles + C.Cycles) * 100 <=
+                    Baseline.Cycles * CycleBudget) and
+               (not SizeBudget or
+                (Spent.Size + C.Size) * 100 <= Baseline.Size * SizeBudget);
+    }
+
+    void spend(Cost const &C) {
+        Spent += C;
+        save();
+    }
+
+    // Admits candidates by increasing cost per value, as long as they fit
+    // together. Costs are compared on cycles, or on size when only the size
+    // is budgeted, ties going to the cheapest and then to the first
+    // candidate. Candidates of no value are never admitted. Nothing is
+    // spent: the passes spend the cost of the candidates they transform.
+    std::vector<bool> select(std::vector<Candidate> const &Candidates) const {
+        std::vector<bool> Selected(Candidates.size(), false);
+        std::vector<unsigned> Order;
+        for (unsigned I = 0; I < Candidates.size(); ++I)
+            if (Candidates[I].Value)
+                Order.push_back(I);
+        auto Ranked = [](Candidate const &C) {
+            return CycleBudget ? C.Estimate.Cycles : C.Estimate.Size;
+        };
+        // Values are not null: comparing the cross products compares the
+        // ratios
+        std::sort(Order.begin(), Order.end(), [&](unsigned I, unsigned J) {
+            Candidate const &CI = Candidates[I], &CJ = Candidates[J];
+            const uint64_t RatioI = Ranked(CI) * CJ.Value,
+                           RatioJ = Ranked(CJ) * CI.Value;
+            if (RatioI != RatioJ)
+                return RatioI < RatioJ;
+            if (Ranked(CI) != Ranked(CJ))
+                return Ranked(CI) < Ranked(CJ);
+            return I < J;
+        });
+        Cost Admitted;
+        for (unsigned I : Order) {
+            Candidate const &C = Candidates[I];
+            if (fits(Admitted + C.Estimate)) {
+                Admitted += C.Estimate;
+                Selected[I] = true;
+            }
+        }
+        return Selected;
+    }
+
+  private:
+    void save() {
+        LLVMContext &Context = M->getContext();
+        Type *Int64Ty = Type::getInt64Ty(Context);
+        Value *Fields[] = {ConstantInt::get(Int64Ty, Baseline.Cycles),
+                           ConstantInt::get(Int64Ty, Baseline.Size),
+                           ConstantInt::get(Int64Ty, Spent.Cycles),
+                           ConstantInt::get(Int64Ty, Spent.Size)};
+        NamedMDNode *Accounts =
+            M->getOrInsertNamedMetadata(BudgetMetadataName);
+        Accounts->dropAllReferences();
+        Accounts->addOperand(MDNode::get(Context, Fields));
+    }
+};
+}
+
+#endif
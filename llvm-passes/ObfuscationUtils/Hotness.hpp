@@ -0,0 +1,51 @@
+#ifndef __HOTNESS_HPP__
+#define __HOTNESS_HPP__
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SharedOptions.hpp"
+
+using namespace llvm;
+
+namespace ObfuscationUtils {
+
+static cl::opt<unsigned> &HotThreshold = getSharedOption<cl::opt<unsigned>>(
+    "obf-hot-threshold",
+    cl::desc("Blocks executed at least this many times per call of their "
+             "function, according to block frequencies (and thus to profile "
+             "data when available), are hot: they get cheaper obfuscation "
+             "parameters (0 disables)"),
+    cl::init(0));
+
+static cl::opt<bool> &SkipHot = getSharedOption<cl::opt<bool>>(
+    "obf-skip-hot", cl::desc("Do not obfuscate hot blocks at all"),
+    cl::init(false));
+
+// Hotness of the blocks of a function, relative to its entry block
+class Hotness {
+    BlockFrequencyInfo const *BFI = nullptr;
+    uint64_t EntryFreq = 0;
+
+  public:
+    // The passes only require BlockFrequencyInfo when this is true
+    static bool enabled() { return HotThreshold != 0; }
+
+    void reset(BlockFrequencyInfo const *NewBFI, Function const &F) {
+        BFI = NewBFI;
+        if (BFI)
+            EntryFreq = BFI->getBlockFreq(&F.getEntryBlock()).getFrequency();
+    }
+
+    bool isHot(BasicBlock const &BB) const {
+        if (not BFI or not EntryFreq)
+            return false;
+        return BFI->getBlockFreq(&BB).getFrequency() / EntryFreq >=
+               HotThreshold;
+    }
+};
+}
+
+#endif
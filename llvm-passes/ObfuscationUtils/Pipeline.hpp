@@ -0,0 +1,98 @@
+#ifndef __PIPELINE_HPP__
+#define __PIPELINE_HPP__
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+
+#include "SharedOptions.hpp"
+
+using namespace llvm;
+
+namespace ObfuscationUtils {
+
+static cl::opt<PassManagerBuilder::ExtensionPointTy> &Placement =
+    getSharedOption<cl::opt<PassManagerBuilder::ExtensionPointTy>>(
+        "obf-placement",
+        cl::desc("Where clang runs the obfuscation passes in its pipeline "
+                 "(-O0 always runs them early)"),
+        cl::values(clEnumValN(PassManagerBuilder::EP_EarlyAsPossible, "early",
+                              "Before any optimization: the whole pipeline "
+                              "goes through the obfuscated code"),
+                   clEnumValN(PassManagerBuilder::EP_ScalarOptimizerLate,
+                              "scalar-late",
+                              "After the scalar optimizations, before the "
+                              "last instcombine and the vectorizers"),
+                   clEnumValN(PassManagerBuilder::EP_OptimizerLast, "last",
+                              "After every optimization, right before code "
+                              "generation"),
+                   clEnumValEnd),
+        cl::init(PassManagerBuilder::EP_EarlyAsPossible));
+
+static cl::opt<bool> &Cleanup = getSharedOption<cl::opt<bool>>(
+    "obf-cleanup",
+    cl::desc("Remove the dead and duplicated code left by the obfuscation "
+             "passes when they run late (see -obf-placement)"),
+    cl::init(true));
+
+// Number of obfuscation passes registered into the standard pipelines, by
+// every module loaded: an option, so that modules share it
+static cl::opt<unsigned> &RegisteredPasses =
+    getSharedOption<cl::opt<unsigned>>(
+        "obf-registered-passes", cl::ReallyHidden,
+        cl::desc("Number of obfuscation passes registered (internal)"),
+        cl::init(0));
+
+// Cleanup run once after the obfuscation passes placed late: duplicated
+// encodings and decodings are merged and unused decode chains removed.
+// Passes which rewrite arithmetic (instcombine, reassociate, GVN...) are
+// left out, they could fold the obfuscated expressions back.
+inline void addCleanupPasses(PassManagerBase &PM) {
+    PM.add(createEarlyCSEPass());
+    PM.add(createAggressiveDCEPass());
+}
+
+// Registers PassT into the standard pipelines of clang, at the extension
+// point chosen with -obf-placement. Options are only known once the command
+// line is parsed, after the plugins are loaded, so the pass is registered at
+// every candidate extension point and only added at the chosen one.
+// Extensions are added in the order they were registered: the last pass
+// registered, whichever module it comes from, adds the cleanup.
+template <typename PassT> class RegisterStandardObfuscation {
+    static unsigned Index;
+
+    template <PassManagerBuilder::ExtensionPointTy EP>
+    static void addPass(const PassManagerBuilder &Builder,
+                        PassManagerBase &PM) {
+        // Late extension points are not run at -O0
+        const PassManagerBuilder::ExtensionPointTy Chosen =
+            Builder.OptLevel == 0 ? PassManagerBuilder::EP_EarlyAsPossible
+                                  : Placement.getValue();
+        if (EP != Chosen)
+            return;
+        PM.add(new PassT());
+        if (EP != PassManagerBuilder::EP_EarlyAsPossible and Cleanup and
+            Index == RegisteredPasses)
+            addCleanupPasses(PM);
+    }
+
+    RegisterStandardPasses Early, ScalarLate, Last;
+
+  public:
+    RegisterStandardObfuscation()
+        : Early(PassManagerBuilder::EP_EarlyAsPossible,
+                addPass<PassManagerBuilder::EP_EarlyAsPossible>),
+          ScalarLate(PassManagerBuilder::EP_ScalarOptimizerLate,
+                     addPass<PassManagerBuilder::EP_ScalarOptimizerLate>),
+          Last(PassManagerBuilder::EP_OptimizerLast,
+               addPass<PassManagerBuilder::EP_OptimizerLast>) {
+        Index = RegisteredPasses + 1;
+        RegisteredPasses = Index;
+    }
+};
+
+template <typename PassT> unsigned RegisterStandardObfuscation<PassT>::Index;
+}
+
+#endif
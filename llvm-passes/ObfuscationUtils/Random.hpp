@@ -0,0 +1,56 @@
+#ifndef __RANDOM_HPP__
+#define __RANDOM_HPP__
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <cstdint>
+
+#include "SharedOptions.hpp"
+
+using namespace llvm;
+
+namespace ObfuscationUtils {
+
+static cl::opt<unsigned> &Seed = getSharedOption<cl::opt<unsigned>>(
+    "obf-seed",
+    cl::desc("Seed of the random choices of the obfuscation passes. The "
+             "choices made for a function only depend on the seed, the pass "
+             "and the function's name, so identical inputs give identical "
+             "outputs"),
+    cl::init(0));
+
+// 64-bit FNV-1a, stable across runs, hosts and LLVM versions
+inline uint64_t hashBytes(StringRef Bytes,
+                          uint64_t Hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char Byte : Bytes) {
+        Hash ^= Byte;
+        Hash *= 0x100000001b3ULL;
+    }
+    return Hash;
+}
+
+// Restarts Generator with a stream specific to PassName and Name. Only names
+// are hashed, not paths or addresses, so that the output does not depend on
+// the build directory or on what was processed before.
+template <typename GeneratorT>
+void seedGenerator(GeneratorT &Generator, StringRef PassName, StringRef Name) {
+    const unsigned SeedValue = Seed;
+    uint64_t Hash = hashBytes(
+        StringRef(reinterpret_cast<const char *>(&SeedValue),
+                  sizeof(SeedValue)));
+    Hash = hashBytes(Name, hashBytes(PassName, Hash));
+    Generator.seed(
+        static_cast<typename GeneratorT::result_type>(Hash ^ (Hash >> 32)));
+}
+
+// The stream of the choices made for F
+template <typename GeneratorT>
+void seedGenerator(GeneratorT &Generator, StringRef PassName,
+                   Function const &F) {
+    seedGenerator(Generator, PassName, F.getName());
+}
+}
+
+#endif
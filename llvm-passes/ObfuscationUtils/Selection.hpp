@@ -0,0 +1,207 @@
+#ifndef __SELECTION_HPP__
+#define __SELECTION_HPP__
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "SharedOptions.hpp"
+
+using namespace llvm;
+
+namespace ObfuscationUtils {
+
+static cl::opt<std::string> &SelectionList =
+    getSharedOption<cl::opt<std::string>>(
+        "obf-list",
+        cl::desc("File of rules selecting the functions to obfuscate, one per "
+                 "line: 'allow <glob> [passes]' or 'deny <glob> [passes]', "
+                 "globs matching (mangled) function names and passes being a "
+                 "comma-separated list of xor, split and zero (all of them by "
+                 "default)"),
+        cl::value_desc("filename"), cl::init(""));
+
+// Matches Name against Pattern, where '*' matches any sequence of characters
+// and '?' any single character
+inline bool matchGlob(StringRef Pattern, StringRef Name) {
+    size_t P = 0, N = 0, StarP = StringRef::npos, StarN = 0;
+    while (N < Name.size()) {
+        if (P < Pattern.size() and
+            (Pattern[P] == '?' or Pattern[P] == Name[N])) {
+            ++P;
+            ++N;
+        } else if (P < Pattern.size() and Pattern[P] == '*') {
+            StarP = P++;
+            StarN = N;
+        } else if (StarP != StringRef::npos) {
+            // Backtracking: the last star matches one more character
+            P = StarP + 1;
+            N = ++StarN;
+        } else {
+            return false;
+        }
+    }
+    while (P < Pattern.size() and Pattern[P] == '*')
+        ++P;
+    return P == Pattern.size();
+}
+
+// Whether a comma-separated list of passes, "all" or empty meaning all of
+// them, names PassName
+inline bool namesPass(StringRef Passes, StringRef PassName) {
+    Passes = Passes.trim();
+    if (Passes.empty())
+        return true;
+    SmallVector<StringRef, 4> Names;
+    Passes.split(Names, ",");
+    for (StringRef Name : Names)
+        if (Name.trim() == PassName or Name.trim() == "all")
+            return true;
+    return false;
+}
+
+// Functions a pass obfuscates. They are selected with:
+// - the annotations __attribute__((annotate("obf:xor,split"))) or
+//   annotate("noobf:zero"), "obf" and "noobf" alone meaning every pass,
+// - the function attributes "obf" and "noobf", whose value is a list of
+//   passes as above (every pass when empty),
+// - the allow and deny rules of -obf-list.
+// Denying wins over allowing. As soon as a module or the list allows some
+// function for a pass, the pass only obfuscates the functions allowed;
+// otherwise it obfuscates every function which is not denied.
+class Selection {
+    struct Rule {
+        bool Allow;
+        std::string Pattern, Passes;
+    };
+
+    // Short name of the pass: xor, split or zero
+    std::string PassName;
+    // Annotated functions of the current module
+    std::set<Function const *> Allowed, Denied;
+    // Whether something allows functions for this pass
+    bool Selective = false;
+
+    // Rules of -obf-list, read once per process
+    static std::vector<Rule> const &rules() {
+        static const std::vector<Rule> Rules = readRules();
+        return Rules;
+    }
+
+    static std::vector<Rule> readRules() {
+        std::vector<Rule> Rules;
+        if (SelectionList.empty())
+            return Rules;
+        auto Buffer = MemoryBuffer::getFile(SelectionList);
+        if (not Buffer)
+            report_fatal_error(Twine("obf-list: cannot read '") +
+                               SelectionList + "': " +
+                               Buffer.getError().message());
+        SmallVector<StringRef, 16> Lines;
+        Buffer.get()->getBuffer().split(Lines, "\n");
+        for (StringRef Line : Lines) {
+            Line = Line.split('#').first.trim();
+            if (Line.empty())
+                continue;
+            SmallVector<StringRef, 3> Fields;
+            Line.split(Fields, " ", -1, false);
+            if ((Fields[0] != "allow" and Fields[0] != "deny") or
+                Fields.size() < 2 or Fields.size() > 3)
+                report_fatal_error(Twine("obf-list: invalid rule '") + Line +
+                                   "'");
+            Rules.push_back({Fields[0] == "allow", Fields[1].str(),
+                             Fields.size() == 3 ? Fields[2].str() : ""});
+        }
+        return Rules;
+    }
+
+    // Applies an annotation or attribute: Kind is obf or noobf, Passes the
+    // list of passes it applies to
+    void apply(Function const *F, StringRef Kind, StringRef Passes) {
+        if (not namesPass(Passes, PassName))
+            return;
+        if (Kind == "obf") {
+            Selective = true;
+            Allowed.insert(F);
+        } else if (Kind == "noobf")
+            Denied.insert(F);
+    }
+
+  public:
+    explicit Selection(StringRef PassName) : PassName(PassName) {}
+
+    // Reads the annotations and attributes of M, to be called before its
+    // functions are run on
+    void reset(Module &M) {
+        Allowed.clear();
+        Denied.clear();
+        Selective = false;
+        for (auto const &R : rules())
+            Selective |= R.Allow and namesPass(R.Passes, PassName);
+
+        // Entries of llvm.global.annotations are (annotated value,
+        // annotation, file, line) structures
+        GlobalVariable *Annotations =
+            M.getNamedGlobal("llvm.global.annotations");
+        if (Annotations and Annotations->hasInitializer())
+            if (auto *Entries =
+                    dyn_cast<ConstantArray>(Annotations->getInitializer()))
+                for (unsigned I = 0; I < Entries->getNumOperands(); ++I) {
+                    auto *Entry =
+                        dyn_cast<ConstantStruct>(Entries->getOperand(I));
+                    if (not Entry or Entry->getNumOperands() < 2)
+                        continue;
+                    auto *F = dyn_cast<Function>(
+                        Entry->getOperand(0)->stripPointerCasts());
+                    auto *String = dyn_cast<GlobalVariable>(
+                        Entry->getOperand(1)->stripPointerCasts());
+                    if (not F or not String or not String->hasInitializer())
+                        continue;
+                    auto *Data = dyn_cast<ConstantDataSequential>(
+                        String->getInitializer());
+                    if (not Data or not Data->isCString())
+                        continue;
+                    auto KindPasses = Data->getAsCString().split(':');
+                    apply(F, KindPasses.first, KindPasses.second);
+                }
+
+        for (auto const &F : M)
+            for (StringRef Kind : {"obf", "noobf"})
+                if (F.getAttributes().hasAttribute(AttributeSet::FunctionIndex,
+                                                   Kind))
+                    apply(&F, Kind,
+                          F.getAttributes()
+                              .getAttribute(AttributeSet::FunctionIndex, Kind)
+                              .getValueAsString());
+    }
+
+    bool isSelected(Function const &F) const {
+        if (Denied.count(&F))
+            return false;
+        bool Allow = Allowed.count(&F);
+        for (auto const &R : rules()) {
+            if (not namesPass(R.Passes, PassName) or
+                not matchGlob(R.Pattern, F.getName()))
+                continue;
+            if (not R.Allow)
+                return false;
+            Allow = true;
+        }
+        return Allow or not Selective;
+    }
+};
+}
+
+#endif
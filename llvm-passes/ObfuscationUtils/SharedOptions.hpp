@@ -0,0 +1,27 @@
+#ifndef __SHARED_OPTIONS_HPP__
+#define __SHARED_OPTIONS_HPP__
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+namespace ObfuscationUtils {
+
+// Options shared by several passes. Each pass is built as its own module and
+// modules may be loaded together, so an option is only created by the first
+// module which asks for it: the other ones get the registered instance.
+// Registering the same option twice aborts the command line parsing.
+template <typename OptionT, typename... Mods>
+OptionT &getSharedOption(const char *Name, Mods const &... Ms) {
+    StringMap<cl::Option *> Registered;
+    cl::getRegisteredOptions(Registered);
+    auto Pos = Registered.find(Name);
+    if (Pos != Registered.end())
+        return *static_cast<OptionT *>(Pos->second);
+    // Options live as long as the process, like static ones
+    return *new OptionT(Name, Ms...);
+}
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __TIMERS_HPP__
+#define __TIMERS_HPP__
+
+namespace ObfuscationUtils {
+
+// Name of the group of the timers of every pass, in the -time-passes report
+static const char TimerGroupName[] = "Obfuscation regions";
+}
+
+#endif
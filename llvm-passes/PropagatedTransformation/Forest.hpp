@@ -0,0 +1,229 @@
+#ifndef __FOREST_HPP__
+#define __FOREST_HPP__
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Instructions.h"
+
+#include <vector>
+
+using namespace llvm;
+
+namespace PropagatedTransformation {
+
+// Disjoint-set forest with union by size and path compression, used to group
+// the eligible instructions of a block into trees in near-linear time.
+class DisjointSets {
+    std::vector<unsigned> Parents;
+    std::vector<unsigned> Sizes;
+    unsigned NumSets = 0;
+
+  public:
+    unsigned makeSet() {
+        Parents.push_back(Parents.size());
+        Sizes.push_back(1u);
+        ++NumSets;
+        return Parents.size() - 1;
+    }
+
+    unsigned find(unsigned Id) {
+        assert(Id < Parents.size() && "Unknown element.");
+        unsigned Root = Id;
+        while (Parents[Root] != Root)
+            Root = Parents[Root];
+        // Path compression
+        while (Parents[Id] != Root) {
+            unsigned Next = Parents[Id];
+            Parents[Id] = Root;
+            Id = Next;
+        }
+        return Root;
+    }
+
+    void unite(unsigned Id1, unsigned Id2) {
+        unsigned Root1 = find(Id1), Root2 = find(Id2);
+        if (Root1 == Root2)
+            return;
+        if (Sizes[Root1] < Sizes[Root2])
+            std::swap(Root1, Root2);
+        Parents[Root2] = Root1;
+        Sizes[Root1] += Sizes[Root2];
+        --NumSets;
+    }
+
+    unsigned countSets() const { return NumSets; }
+};
+}
+
+class Forest_t;
+
+// A tree is a view on a contiguous range of its forest's nodes.
+// Nodes are kept in block order (blocks in reverse post-order for trees
+// spanning a function), which is a topological order of the tree: the
+// operands of a node always come before it, unless the node is a phi.
+class Tree_t {
+    friend class Forest_t;
+
+    Forest_t const *Owner;
+    unsigned NodeBegin, NodeEnd, RootBegin, RootEnd;
+
+    Tree_t(Forest_t const &F, unsigned NB, unsigned NE, unsigned RB,
+           unsigned RE)
+        : Owner(&F), NodeBegin(NB), NodeEnd(NE), RootBegin(RB), RootEnd(RE) {}
+
+  public:
+    typedef ArrayRef<Instruction *> range_type;
+
+    unsigned size() const { return NodeEnd - NodeBegin; }
+    Instruction *front() const { return nodes().front(); }
+
+    inline range_type nodes() const;
+    // Nodes without any user in the tree, computed once at construction
+    inline range_type roots() const;
+    // Operands of Node which are nodes of the tree
+    inline range_type successors(Instruction const *Node) const;
+    inline bool contains(Value const *V) const;
+};
+
+// Per-block (or per-function) storage of every tree: nodes, successors and
+// roots are stored in flat arrays indexed by dense node indices.
+class Forest_t {
+    friend class Tree_t;
+
+    std::vector<Instruction *> Nodes;
+    DenseMap<Value const *, unsigned> NodeIds;
+    // Successors of Nodes[I] are Successors[SuccessorOffsets[I]] up to
+    // Successors[SuccessorOffsets[I + 1]]
+    std::vector<unsigned> SuccessorOffsets;
+    std::vector<Instruction *> Successors;
+    std::vector<Instruction *> Roots;
+    std::vector<Tree_t> Trees;
+
+  public:
+    typedef std::vector<Tree_t>::const_iterator const_iterator;
+
+    Forest_t() = default;
+    // Trees refer to their forest
+    Forest_t(Forest_t const &) = delete;
+    Forest_t &operator=(Forest_t const &) = delete;
+
+    const_iterator begin() const { return Trees.cbegin(); }
+    const_iterator end() const { return Trees.cend(); }
+    size_t size() const { return Trees.size(); }
+    bool empty() const { return Trees.empty(); }
+
+    void clear() {
+        Nodes.clear();
+        NodeIds.clear();
+        SuccessorOffsets.clear();
+        Successors.clear();
+        Roots.clear();
+        Trees.clear();
+    }
+
+    // Lays out the trees found by the scan of a block or function: BlockNodes
+    // are the eligible instructions in block order, BlockNodes[I] being
+    // element I of Sets. Trees made only of phi nodes are dropped, they have
+    // no operation to transform: their phi nodes are left as they are.
+    void build(ArrayRef<Instruction *> BlockNodes,
+               PropagatedTransformation::DisjointSets &Sets) {
+        clear();
+
+        // Numbering trees by first appearance and counting their nodes
+        std::vector<unsigned> TreeOf(BlockNodes.size()),
+            TreeIds(BlockNodes.size(), ~0u), TreeSizes;
+        std::vector<bool> HasOperation;
+        for (unsigned I = 0; I < BlockNodes.size(); ++I) {
+            unsigned &TreeId = TreeIds[Sets.find(I)];
+            if (TreeId == ~0u) {
+                TreeId = TreeSizes.size();
+                TreeSizes.push_back(0u);
+                HasOperation.push_back(false);
+            }
+            TreeOf[I] = TreeId;
+            ++TreeSizes[TreeId];
+            if (not isa<PHINode>(BlockNodes[I]))
+                HasOperation[TreeId] = true;
+        }
+
+        // Numbering the trees kept, and laying them out one after the other
+        std::vector<unsigned> Kept(TreeSizes.size(), ~0u), TreeOffsets;
+        unsigned NumNodes = 0;
+        for (unsigned TreeId = 0; TreeId < TreeSizes.size(); ++TreeId)
+            if (HasOperation[TreeId]) {
+                Kept[TreeId] = TreeOffsets.size();
+                TreeOffsets.push_back(NumNodes);
+                NumNodes += TreeSizes[TreeId];
+            }
+        const unsigned NumTrees = TreeOffsets.size();
+
+        // Counting sort of the nodes by tree, keeping block order
+        std::vector<unsigned> Next(TreeOffsets), NodeTrees(NumNodes);
+        Nodes.resize(NumNodes);
+        for (unsigned I = 0; I < BlockNodes.size(); ++I) {
+            const unsigned TreeId = Kept[TreeOf[I]];
+            if (TreeId == ~0u)
+                continue;
+            const unsigned Id = Next[TreeId]++;
+            Nodes[Id] = BlockNodes[I];
+            NodeIds[BlockNodes[I]] = Id;
+            NodeTrees[Id] = TreeId;
+        }
+
+        // Successors, and marking every node used inside its tree. Operands
+        // may be nodes of another tree, e.g. once a tree is cut.
+        std::vector<bool> HasTreeUser(NumNodes, false);
+        SuccessorOffsets.reserve(NumNodes + 1);
+        Successors.reserve(NumNodes);
+        for (unsigned Id = 0; Id < NumNodes; ++Id) {
+            SuccessorOffsets.push_back(Successors.size());
+            for (auto const &Op : Nodes[Id]->operands()) {
+                auto Pos = NodeIds.find(Op);
+                if (Pos == NodeIds.end() or
+                    NodeTrees[Pos->second] != NodeTrees[Id])
+                    continue;
+                Successors.push_back(Nodes[Pos->second]);
+                HasTreeUser[Pos->second] = true;
+            }
+        }
+        SuccessorOffsets.push_back(Successors.size());
+
+        Trees.reserve(NumTrees);
+        for (unsigned TreeId = 0; TreeId < NumTrees; ++TreeId) {
+            const unsigned NodeBegin = TreeOffsets[TreeId],
+                           NodeEnd = Next[TreeId],
+                           RootBegin = Roots.size();
+            for (unsigned Id = NodeBegin; Id < NodeEnd; ++Id)
+                if (not HasTreeUser[Id])
+                    Roots.push_back(Nodes[Id]);
+            Trees.push_back(
+                Tree_t(*this, NodeBegin, NodeEnd, RootBegin, Roots.size()));
+        }
+    }
+};
+
+Tree_t::range_type Tree_t::nodes() const {
+    return range_type(Owner->Nodes.data() + NodeBegin,
+                      Owner->Nodes.data() + NodeEnd);
+}
+
+Tree_t::range_type Tree_t::roots() const {
+    return range_type(Owner->Roots.data() + RootBegin,
+                      Owner->Roots.data() + RootEnd);
+}
+
+Tree_t::range_type Tree_t::successors(Instruction const *Node) const {
+    const unsigned Id = Owner->NodeIds.lookup(Node);
+    assert(contains(Node) && "Not a node of this tree.");
+    return range_type(Owner->Successors.data() + Owner->SuccessorOffsets[Id],
+                      Owner->Successors.data() +
+                          Owner->SuccessorOffsets[Id + 1]);
+}
+
+bool Tree_t::contains(Value const *V) const {
+    auto Pos = Owner->NodeIds.find(V);
+    return Pos != Owner->NodeIds.end() and Pos->second >= NodeBegin and
+           Pos->second < NodeEnd;
+}
+
+#endif
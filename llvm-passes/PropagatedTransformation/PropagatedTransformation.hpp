@@ -4,48 +4,105 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/Timer.h"
 
+#include "Forest.hpp"
+#include "../ObfuscationUtils/Budget.hpp"
+#include "../ObfuscationUtils/Hotness.hpp"
+#include "../ObfuscationUtils/Timers.hpp"
+
+#include <algorithm>
+#include <deque>
 #include <map>
+#include <numeric>
+#include <random>
 #include <set>
-#include <list>
 #include <tuple>
 #include <vector>
 #include <unordered_map>
 
 using namespace llvm;
 
-struct Tree_t : public std::unordered_map<Instruction *, std::set<Instruction *>> {
-
-    mapped_type roots() const {
-        mapped_type Roots;
-        std::transform(begin(),
-                       end(),
-                       std::inserter(Roots, Roots.begin()),
-                       [this](Tree_t::value_type const &It) { return It.first; });
+// Counters are reported under the DEBUG_TYPE of the including pass
+#ifndef DEBUG_TYPE
+#error "DEBUG_TYPE must be defined before including PropagatedTransformation.hpp"
+#endif
 
-        for (auto const &Node : (*this))
-            std::for_each(Node.second.cbegin(),
-                          Node.second.cend(),
-                          [&Roots](Tree_t::mapped_type::key_type const &Successors){Roots.erase(Successors);});
-        return Roots;
-    }
-};
+STATISTIC(NumTrees, "Number of trees found");
+STATISTIC(NumTreeNodes, "Number of tree nodes found");
+STATISTIC(MaxTreeSize, "Size of the largest tree found");
+STATISTIC(NumTreesTransformed, "Number of trees transformed");
+STATISTIC(NumTreeFailures, "Number of trees which could not be transformed");
+STATISTIC(NumOperandsEncoded, "Number of operands transformed");
+STATISTIC(NumOperandsReused, "Number of transformed operands reused");
+STATISTIC(NumConversionsBack, "Number of nodes converted back");
+STATISTIC(NumPhiNodes, "Number of phi nodes carrying transformed values");
+STATISTIC(NumInstructionsEmitted, "Number of instructions emitted");
+STATISTIC(NumHotTrees, "Number of hot trees made cheaper or skipped");
+STATISTIC(NumOverBudget, "Number of trees left out by the overhead budget");
 
 namespace PropagatedTransformation {
+
 class PropagatedTransformation {
   protected:
     std::default_random_engine Generator;
 
-    std::list<Tree_t> Forest;
-    std::unordered_map<Instruction *, std::reference_wrapper<Tree_t>> TreeMap;
+    Forest_t Forest;
 
-    std::map<std::pair<Value *, unsigned>, std::vector<Value *>> TransfoRegister;
+    // Transformed values of the current function. A deque keeps them in
+    // place, the maps below point into it.
+    std::deque<std::vector<Value *>> TransformedValues;
+
+    // Transformed nodes of the current tree
+    DenseMap<Value const *, std::vector<Value *> const *> TransfoRegister;
+
+    // Transformed operand, inserted right before Anchor, an instruction of
+    // the original function
+    struct Form {
+        Instruction *Anchor;
+        std::vector<Value *> const *Values;
+    };
+
+    // Transformed operands of the current function, by operand and
+    // encodingKey(). An operand may have been transformed in several places,
+    // the one dominating the new user is reused.
+    typedef std::pair<Value *, unsigned> EncodingKey_t;
+    DenseMap<EncodingKey_t, SmallVector<Form, 1>> EncodingCache;
+
+    // Positions of the instructions of the current function in their block,
+    // numbered before anything is transformed
+    DenseMap<Instruction const *, unsigned> InstructionOrder;
 
     unsigned SizeParam;
 
+    DominatorTree *DT = nullptr;
+
+    // Whether trees span the whole function and go through phi nodes
+    bool FunctionLevelTrees = false;
+
+    // Nodes converted back, their out of tree users being rewired once their
+    // whole tree is transformed
+    struct Conversion {
+        Instruction *Node;
+        Value *Back;
+        std::vector<Instruction *> Users;
+    };
+    std::vector<Conversion> Conversions;
+
+    ObfuscationUtils::Budget Budget;
+    ObfuscationUtils::Hotness Hotness;
+
     // Pure virtual members
     virtual BinaryOperator *isEligibleInstruction(Instruction *Inst) const = 0;
     // Should return an empty vector if sthg went wrong
@@ -59,74 +116,297 @@ class PropagatedTransformation {
                       Instruction *OriginalInstruction,
                       IRBuilder<> &Builder) = 0;
 
+    // Estimated costs of transformOperand on a value of type Ty, of
+    // applyNewOperation on Node and of transformBackOperand to type Ty, with
+    // the current parameters. Only called when the budget is enabled.
+    virtual ObfuscationUtils::Cost operandCost(Type *Ty) const = 0;
+    virtual ObfuscationUtils::Cost nodeCost(Instruction const *Node) const = 0;
+    virtual ObfuscationUtils::Cost backCost(Type *Ty) const = 0;
+
+    // Parameters of the transformation of operands: operands transformed
+    // with the same key are interchangeable
+    virtual unsigned encodingKey() const { return SizeParam; }
+
+    // Types of the values an operand of type Ty is transformed into, needed
+    // to carry transformed values through phi nodes. An empty vector (the
+    // default) makes trees with phi nodes fail.
+    virtual std::vector<Type *> transformedTypes(Type *Ty) const {
+        return {};
+    }
+
+    // Phi nodes which may carry transformed values in function-level trees.
+    // The others are leaves: their value is transformed where it is used.
+    virtual bool isEligiblePhi(PHINode *Phi) const {
+        return Phi->getType()->isIntegerTy();
+    }
+
     // Implemented members
-    void populateForest(BasicBlock &BB) {
-        TreeMap.clear();
-        Forest.clear();
+
+    // To be called before transforming the trees of a function
+    void resetTransformations(DominatorTree &FunctionDT) {
+        DT = &FunctionDT;
         TransfoRegister.clear();
+        EncodingCache.clear();
+        TransformedValues.clear();
+        InstructionOrder.clear();
+        for (auto const &BB : *FunctionDT.getRoot()->getParent()) {
+            unsigned Position = 0;
+            for (auto const &I : BB)
+                InstructionOrder[&I] = Position++;
+        }
+    }
+
+    // Builds and transforms the forests of F: a single one with
+    // function-level trees, one per block otherwise. TransformForest()
+    // transforms the current forest and returns whether it changed anything.
+    template <typename TransformForestT>
+    bool transformFunction(Function &F, bool FunctionTrees,
+                           TransformForestT TransformForest) {
+        bool modified = false;
+        if (FunctionTrees) {
+            size_t SizeBefore = 0;
+            for (auto const &BB : F)
+                SizeBefore += BB.size();
+
+            populateForest(F);
+            modified |= TransformForest();
+
+            for (auto const &BB : F)
+                NumInstructionsEmitted += BB.size();
+            NumInstructionsEmitted -= SizeBefore;
+            return modified;
+        }
+        for (auto &BB : F) {
+            const size_t SizeBefore = BB.size();
+            populateForest(BB);
+            modified |= TransformForest();
+            NumInstructionsEmitted += BB.size() - SizeBefore;
+        }
+        return modified;
+    }
+
+    // Transforms the trees of the forest. Choose(Tree, T, Hot) sets the
+    // parameters of T, the Tree-th tree, and returns whether some fit it;
+    // hot trees skipped with -obf-skip-hot are not given any. With an
+    // overhead budget, trees with parameters are then admitted by increasing
+    // estimated cost per node, as long as the budget allows. Every other
+    // tree goes to Transform(Tree, T), which restores the parameters of T and
+    // transforms it, or reports why it cannot.
+    template <typename ChooseT, typename TransformT>
+    bool transformForest(ChooseT Choose, TransformT Transform) {
+        const bool Budgeted = ObfuscationUtils::Budget::enabled();
+        std::vector<bool> Skipped, Chosen;
+        std::vector<ObfuscationUtils::Candidate> Candidates;
+        for (auto const &T : Forest) {
+            const unsigned Tree = Skipped.size();
+            // Hot trees are skipped or get the cheapest parameters
+            const bool Hot = isHot(T);
+            if (Hot)
+                ++NumHotTrees;
+            Skipped.push_back(Hot and ObfuscationUtils::SkipHot);
+            Chosen.push_back(not Skipped.back() and Choose(Tree, T, Hot));
+            if (not Budgeted)
+                continue;
+            if (Chosen.back())
+                Candidates.push_back({treeCost(T), T.size()});
+            else
+                Candidates.push_back({ObfuscationUtils::Cost(), 0});
+        }
+        std::vector<bool> Selected =
+            Budgeted ? Budget.select(Candidates)
+                     : std::vector<bool>(Forest.size(), true);
+
+        bool modified = false;
+        unsigned Tree = 0;
+        for (auto const &T : Forest) {
+            const unsigned I = Tree++;
+            if (Skipped[I])
+                continue;
+            if (Chosen[I] and not Selected[I]) {
+                ++NumOverBudget;
+                continue;
+            }
+            const bool Transformed = Transform(I, T);
+            if (Transformed and Budgeted)
+                Budget.spend(Candidates[I].Estimate);
+            modified |= Transformed;
+        }
+        return modified;
+    }
 
+    // A tree is hot as soon as one of its nodes is
+    bool isHot(Tree_t const &T) const {
+        return std::any_of(T.nodes().begin(), T.nodes().end(),
+                           [this](Instruction const *Node) {
+                               return Hotness.isHot(*Node->getParent());
+                           });
+    }
+
+    void populateForest(BasicBlock &BB) {
+        NamedRegionTimer Timer(DEBUG_TYPE " populateForest",
+                               ObfuscationUtils::TimerGroupName,
+                               TimePassesIsEnabled);
+        FunctionLevelTrees = false;
+
+        // Dense indices of the eligible instructions, in block order
+        std::vector<Instruction *> Nodes;
+        std::unordered_map<Instruction *, unsigned> NodeIds;
+        DisjointSets Sets;
+
+        // Operands of a (non phi) instruction are defined before it in the
+        // block, so a single forward scan sees every edge of every tree.
         for (typename BasicBlock::iterator I = BB.getFirstInsertionPt(),
                                            end = BB.end();
              I != end; ++I) {
             Instruction *Inst = &*I;
-            if (isEligibleInstruction(Inst)) {
-                // Adding an empty tree to the Forest to pass it to walkInstructions
-                // If a merge occurs an older tree will be removed this
-                // means that there can't be any empty tree in the Torest
-                Forest.emplace_back();
-                walkInstructions(Forest.back(), Inst);
+            if (not isEligibleInstruction(Inst))
+                continue;
+            const unsigned Id = Sets.makeSet();
+            NodeIds.emplace(Inst, Id);
+            Nodes.push_back(Inst);
+            for (auto const &Op : Inst->operands()) {
+                auto Pos = NodeIds.find(dyn_cast<Instruction>(&Op));
+                if (Pos != NodeIds.end())
+                    Sets.unite(Id, Pos->second);
             }
         }
+
+        // Laying out each tree once, now that the partition is known
+        Forest.build(Nodes, Sets);
+        updateForestStatistics();
     }
 
+    // Function-level trees: integer phi nodes are nodes too, so that values
+    // stay transformed across blocks, and loop-carried values across
+    // iterations.
+    void populateForest(Function &F) {
+        NamedRegionTimer Timer(DEBUG_TYPE " populateForest",
+                               ObfuscationUtils::TimerGroupName,
+                               TimePassesIsEnabled);
+        FunctionLevelTrees = true;
+
+        std::vector<Instruction *> Nodes;
+        std::unordered_map<Instruction *, unsigned> NodeIds;
+        std::vector<PHINode *> Phis;
+        DisjointSets Sets;
+
+        // In reverse post-order, the operands of an instruction which is not
+        // a phi node are seen before it. Incoming values of phi nodes may
+        // come later: they are united once every block has been scanned.
+        ReversePostOrderTraversal<Function *> RPOT(&F);
+        for (BasicBlock *BB : RPOT)
+            for (auto &I : *BB) {
+                Instruction *Inst = &I;
+                PHINode *Phi = dyn_cast<PHINode>(Inst);
+                if (Phi ? not isEligiblePhi(Phi)
+                        : not isEligibleInstruction(Inst))
+                    continue;
+                const unsigned Id = Sets.makeSet();
+                NodeIds.emplace(Inst, Id);
+                Nodes.push_back(Inst);
+                if (Phi) {
+                    Phis.push_back(Phi);
+                    continue;
+                }
+                for (auto const &Op : Inst->operands()) {
+                    auto Pos = NodeIds.find(dyn_cast<Instruction>(&Op));
+                    if (Pos != NodeIds.end())
+                        Sets.unite(Id, Pos->second);
+                }
+            }
+        for (PHINode *Phi : Phis)
+            for (unsigned I = 0; I < Phi->getNumIncomingValues(); ++I) {
+                auto Pos = NodeIds.find(
+                    dyn_cast<Instruction>(Phi->getIncomingValue(I)));
+                if (Pos != NodeIds.end())
+                    Sets.unite(NodeIds.at(Phi), Pos->second);
+            }
+
+        Forest.build(Nodes, Sets);
+        updateForestStatistics();
+    }
 
-    void walkInstructions(Tree_t &T, Instruction *Inst) {
-        if (not isEligibleInstruction(Inst))
-            return;
-        // Look for the Inst in the TreeMap
-        auto Pos = TreeMap.find(Inst);
-        if (Pos == TreeMap.end()) {
-            T.emplace(Inst, Tree_t::mapped_type());
-            for (auto const &Op : Inst->operands()) {
-                Instruction *OperandInst = dyn_cast<Instruction>(&Op);
-                if (OperandInst and isEligibleInstruction(OperandInst))
-                    T.at(Inst).insert(OperandInst);
+    // Cuts the trees of the forest at the Cuts nodes, each of them becoming
+    // the root of a new tree: it is converted back for its former users,
+    // which transform it again as any other operand. Phi nodes cut are also
+    // cut from their incoming values: they are left out of the trees, and
+    // their users transform their original value.
+    void cutForest(std::set<Value const *> const &Cuts) {
+        std::vector<Instruction *> Nodes;
+        std::unordered_map<Instruction *, unsigned> NodeIds;
+        DisjointSets Sets;
+        // Trees are laid out one after the other, each in block order
+        for (auto const &T : Forest)
+            for (Instruction *Node : T.nodes()) {
+                NodeIds.emplace(Node, Sets.makeSet());
+                Nodes.push_back(Node);
             }
-            TreeMap.emplace(Inst, T);
-            for (auto const &NVUse : Inst->uses()) {
-                Instruction *UseInst = dyn_cast<Instruction>(NVUse.getUser());
-                if (not UseInst)
+        for (auto const &T : Forest)
+            for (Instruction *Node : T.nodes()) {
+                // Left in trees of phi nodes alone, which build() drops
+                if (isa<PHINode>(Node) and Cuts.count(Node))
                     continue;
-                walkInstructions(T, UseInst);
-            }
-        } else {
-            Tree_t &OlderTree = Pos->second.get();
-            if (&OlderTree != &T) {
-                // Merge trees
-                for (auto It : OlderTree) {
-                    T[It.first].insert(OlderTree[It.first].begin(),
-                                       OlderTree[It.first].end());
-                    // Redirecting TreeMap refs
-                    TreeMap.at(It.first) = T;
-                }
-                Forest.remove_if(
-                    [&OlderTree](Tree_t const &T) { return &T == &OlderTree; });
+                for (Instruction *Successor : T.successors(Node))
+                    if (not Cuts.count(Successor))
+                        Sets.unite(NodeIds.at(Node), NodeIds.at(Successor));
             }
+        Forest.build(Nodes, Sets);
+    }
+
+    void updateForestStatistics() {
+        NumTrees += Forest.size();
+        for (auto const &T : Forest) {
+            NumTreeNodes += T.size();
+            if (T.size() > MaxTreeSize)
+                MaxTreeSize = T.size();
+        }
+    }
+
+    // Estimated cost of transforming T with the current parameters: operands
+    // out of the tree are transformed once (constants fold), nodes become
+    // new operations and the ones used out of the tree are converted back
+    ObfuscationUtils::Cost treeCost(Tree_t const &T) const {
+        ObfuscationUtils::Cost C;
+        std::set<Value const *> Operands;
+        for (Instruction *Node : T.nodes()) {
+            for (auto const &Op : Node->operands())
+                if (not T.contains(Op) and not isa<Constant>(Op) and
+                    Operands.insert(Op).second)
+                    C += operandCost(Op->getType());
+            if (not isa<PHINode>(Node))
+                C += nodeCost(Node);
+            if (not outOfTreeUsers(Node, T).empty())
+                C += backCost(Node->getType());
         }
+        return C;
     }
 
     std::vector<unsigned> getShuffledRange(unsigned UpTo) {
         std::vector<unsigned> Range(UpTo);
         std::iota(Range.begin(), Range.end(), 0u);
-        std::random_shuffle(Range.begin(), Range.end());
+        std::shuffle(Range.begin(), Range.end(), Generator);
         return Range;
     }
 
-    void replaceUses(Value *OriginalValue, Value *NewValue, Tree_t const &T) {
-        for (auto const &NVUse : OriginalValue->uses()) {
+    // Users of a node which are not part of its tree: they need the node's
+    // value in its original form.
+    std::vector<Instruction *> outOfTreeUsers(Value *Node,
+                                              Tree_t const &T) const {
+        std::vector<Instruction *> Users;
+        for (auto const &NVUse : Node->uses()) {
             Instruction *UseInst = dyn_cast<Instruction>(NVUse.getUser());
-            if (not UseInst or T.find(UseInst) != T.cend())
-                continue;
+            if (UseInst and not T.contains(UseInst))
+                Users.push_back(UseInst);
+        }
+        return Users;
+    }
+
+    // Users are collected beforehand: rewiring an operand moves its Use to
+    // NewValue's use list, which would break an iteration over
+    // OriginalValue->uses().
+    void replaceUses(Value *OriginalValue, Value *NewValue,
+                     std::vector<Instruction *> const &Users) {
+        for (Instruction *UseInst : Users) {
             for (unsigned I = 0; I < UseInst->getNumOperands(); ++I) {
                 if (UseInst->getOperand(I) == OriginalValue) {
                     UseInst->setOperand(I, NewValue);
@@ -135,28 +415,192 @@ class PropagatedTransformation {
         }
     }
 
-    // Checking if we've already transformed the operand or transform it
+    std::vector<Value *> const &
+    keepTransformed(std::vector<Value *> &&Values) {
+        TransformedValues.push_back(std::move(Values));
+        return TransformedValues.back();
+    }
+
+    // Whether F may be used at the insertion point of Builder. Within a
+    // block, the positions of the original instructions are compared:
+    // DominatorTree walks the block instead, which would make each lookup
+    // linear in its size. Values transformed together are inserted next to
+    // each other, so the first instruction among them stands for all of
+    // them.
+    bool isAvailable(Form const &F, IRBuilder<> &Builder) const {
+        assert(DT && "resetTransformations was not called.");
+        auto First = std::find_if(F.Values->begin(), F.Values->end(),
+                                  [](Value *V) { return isa<Instruction>(V); });
+        if (First == F.Values->end())
+            return true;
+        Instruction *InsertPt = &*Builder.GetInsertPoint();
+        BasicBlock *FormBB = F.Anchor->getParent(),
+                   *InsertBB = InsertPt->getParent();
+        if (FormBB != InsertBB)
+            return DT->dominates(FormBB, InsertBB);
+        auto Anchor = InstructionOrder.find(F.Anchor),
+             At = InstructionOrder.find(InsertPt);
+        if (Anchor == InstructionOrder.end() or At == InstructionOrder.end())
+            return DT->dominates(cast<Instruction>(*First), InsertPt);
+        return Anchor->second <= At->second;
+    }
+
+    // Checking if we've already transformed the operand where it dominates
+    // the insertion point, or transform it
     ErrorOr<std::vector<Value *> const &> findOrTransformOperand(Value *Operand,
                                                        IRBuilder<> &Builder) {
-        auto Pos = TransfoRegister.find(std::make_pair(Operand, SizeParam));
-        if (Pos == TransfoRegister.end()) {
-            std::vector<Value *> NewOperands =
-                transformOperand(Operand, Builder);
-            if (NewOperands.empty()) {
-                dbgs() << "Obfuscation failed\n";
-                return {std::errc::operation_not_supported};
+        auto &Forms = EncodingCache[std::make_pair(Operand, encodingKey())];
+        for (auto const &F : Forms)
+            if (isAvailable(F, Builder)) {
+                ++NumOperandsReused;
+                return *F.Values;
+            }
+        Instruction *Anchor = &*Builder.GetInsertPoint();
+        std::vector<Value *> NewOperands = transformOperand(Operand, Builder);
+        if (NewOperands.empty()) {
+            DEBUG(dbgs() << "Obfuscation failed\n");
+            return {std::errc::operation_not_supported};
+        }
+        ++NumOperandsEncoded;
+        auto const &Values = keepTransformed(std::move(NewOperands));
+        Forms.push_back({Anchor, &Values});
+        return Values;
+    }
+
+    // The transformed form of a phi node is made of phi nodes, created empty
+    // because their incoming values may not be transformed yet
+    bool createTransformedPhi(PHINode *Phi) {
+        std::vector<Type *> Types = transformedTypes(Phi->getType());
+        if (Types.empty())
+            return false;
+        IRBuilder<> Builder(Phi);
+        std::vector<Value *> NewPhis;
+        for (Type *Ty : Types)
+            NewPhis.push_back(
+                Builder.CreatePHI(Ty, Phi->getNumIncomingValues()));
+        TransfoRegister[Phi] = &keepTransformed(std::move(NewPhis));
+        ++NumPhiNodes;
+        return true;
+    }
+
+    // Incoming values which are not nodes are transformed at the end of
+    // their incoming block: for a loop-carried value, in the preheader only
+    bool completeTransformedPhi(PHINode *Phi, Tree_t const &T) {
+        auto const &NewPhis = *TransfoRegister.lookup(Phi);
+        for (unsigned I = 0; I < Phi->getNumIncomingValues(); ++I) {
+            Value *Incoming = Phi->getIncomingValue(I);
+            BasicBlock *IncomingBB = Phi->getIncomingBlock(I);
+            ErrorOr<const std::vector<Value *> &> NewIncoming{
+                std::errc::operation_not_supported};
+            if (T.contains(Incoming)) {
+                NewIncoming = *TransfoRegister.lookup(Incoming);
             } else {
-                TransfoRegister.emplace(std::make_pair(Operand, SizeParam),
-                                        std::move(NewOperands));
-                return {TransfoRegister.at(std::make_pair(Operand, SizeParam))};
+                // e.g. the result of an invoke
+                if (Incoming == IncomingBB->getTerminator())
+                    return false;
+                IRBuilder<> Builder(IncomingBB->getTerminator());
+                NewIncoming = findOrTransformOperand(Incoming, Builder);
+            }
+            if (not NewIncoming)
+                return false;
+            for (unsigned J = 0; J < NewPhis.size(); ++J)
+                cast<PHINode>(NewPhis[J])
+                    ->addIncoming(NewIncoming.get()[J], IncomingBB);
+        }
+        return true;
+    }
+
+    // Transforms every node of the tree. Nodes are visited in block order,
+    // which is a post-order of the tree: the operands of a node are always
+    // transformed before it, and operands encoded for a node dominate every
+    // later node that reuses them. Phi nodes, whose incoming values may be
+    // defined later, are created first and completed last.
+    // Out of tree users are only rewired once the whole tree succeeded.
+    bool transformTree(Tree_t const &T) {
+        NamedRegionTimer Timer(DEBUG_TYPE " transformTree",
+                               ObfuscationUtils::TimerGroupName,
+                               TimePassesIsEnabled);
+        Conversions.clear();
+        TransfoRegister.clear();
+
+        std::vector<PHINode *> Phis;
+        for (Instruction *Inst : T.nodes())
+            if (PHINode *Phi = dyn_cast<PHINode>(Inst))
+                Phis.push_back(Phi);
+        assert(Phis.size() < T.size() && "Trees of phi nodes are dropped.");
+
+        bool Success = true;
+        for (PHINode *Phi : Phis)
+            Success = Success and createTransformedPhi(Phi);
+        for (Instruction *Inst : T.nodes())
+            if (Success and not isa<PHINode>(Inst))
+                Success = bool(transformNode(Inst, T));
+        for (PHINode *Phi : Phis)
+            Success = Success and completeTransformedPhi(Phi, T) and
+                      convertBack(Phi, T);
+
+        if (not Success) {
+            // Incomplete phi nodes would make the function invalid, the rest
+            // of the transformed values is dead code
+            for (PHINode *Phi : Phis) {
+                auto const *NewPhis = TransfoRegister.lookup(Phi);
+                if (not NewPhis)
+                    continue;
+                for (Value *NewPhi : *NewPhis) {
+                    NewPhi->replaceAllUsesWith(
+                        UndefValue::get(NewPhi->getType()));
+                    cast<PHINode>(NewPhi)->eraseFromParent();
+                }
             }
-        } else
-            return Pos->second;
+            ++NumTreeFailures;
+            return false;
+        }
+
+        for (auto const &C : Conversions)
+            replaceUses(C.Node, C.Back, C.Users);
+        ++NumTreesTransformed;
+        return true;
     }
 
+    // Where Node is converted back for Users. With function-level trees, it
+    // is the nearest common dominator of the users, e.g. the exit of a loop
+    // for a loop-carried value only used after the loop.
+    Instruction *conversionPoint(Instruction *Node,
+                                 std::vector<Instruction *> const &Users) {
+        BasicBlock *NodeBB = Node->getParent();
+        Instruction *AtNode =
+            isa<PHINode>(Node) ? &*NodeBB->getFirstInsertionPt() : Node;
+        if (not FunctionLevelTrees)
+            return AtNode;
+        BasicBlock *BB = Users.front()->getParent();
+        for (Instruction *User : Users) {
+            if (isa<PHINode>(User))
+                return AtNode;
+            BB = DT->findNearestCommonDominator(BB, User->getParent());
+        }
+        return BB == NodeBB ? AtNode : &*BB->getFirstInsertionPt();
+    }
+
+    // Converting a node back to base 2 only if something outside of the tree
+    // uses it, other nodes use the transformed values.
+    bool convertBack(Instruction *Node, Tree_t const &T) {
+        auto Users = outOfTreeUsers(Node, T);
+        if (Users.empty())
+            return true;
+        IRBuilder<> Builder(conversionPoint(Node, Users));
+        Value *InvertResult = transformBackOperand(
+            *TransfoRegister.lookup(Node), Builder);
+        if (not InvertResult)
+            return false;
+        Conversions.push_back({Node, InvertResult, std::move(Users)});
+        ++NumConversionsBack;
+        return true;
+    }
+
+    // Transforms a single node, its tree operands must already have been
+    // transformed.
     ErrorOr<std::vector<Value *> const &>
-    RecursiveTransform(Instruction *Inst, Tree_t const &T,
-                       BasicBlock const &CurrentBB) {
+    transformNode(Instruction *Inst, Tree_t const &T) {
         assert(Inst && "Invalid instruction.");
         IRBuilder<> Builder(Inst);
 
@@ -165,24 +609,17 @@ class PropagatedTransformation {
         ErrorOr<const std::vector<Value *>&> NewOperands1{std::errc::operation_not_supported},
                                              NewOperands2{std::errc::operation_not_supported};
 
-        auto const &Successors = T.at(Inst);
-
-        Instruction *IOperand1 = dyn_cast<Instruction>(Operand1),
-                    *IOperand2 = dyn_cast<Instruction>(Operand2);
-
         // If Operand1 is not a node (i.e not a xor)
-        if (not IOperand1 or IOperand1->getParent() != &CurrentBB or
-            Successors.find(IOperand1) == Successors.cend())
+        if (not T.contains(Operand1))
             NewOperands1 = findOrTransformOperand(Operand1, Builder);
         else
-            NewOperands1 = RecursiveTransform(IOperand1, T, CurrentBB);
+            NewOperands1 = *TransfoRegister.lookup(Operand1);
 
         // Idem for Operand2
-        if (not IOperand2 or IOperand2->getParent() != &CurrentBB or
-            Successors.find(IOperand2) == Successors.cend())
+        if (not T.contains(Operand2))
             NewOperands2 = findOrTransformOperand(Operand2, Builder);
         else
-            NewOperands2 = RecursiveTransform(IOperand2, T, CurrentBB);
+            NewOperands2 = *TransfoRegister.lookup(Operand2);
 
         if (not NewOperands1 or not NewOperands2)
             return {std::errc::operation_not_supported};
@@ -192,19 +629,13 @@ class PropagatedTransformation {
         if (NewValues.empty())
             return {std::errc::operation_not_supported};
 
-        // Preparing the result in base 2 for later use
-        // Should be optimized out if we don't use it.
-        Value *InvertResult = transformBackOperand(NewValues, Builder);
+        auto const &NewNode = keepTransformed(std::move(NewValues));
+        TransfoRegister[Inst] = &NewNode;
 
-        if (not InvertResult)
+        if (not convertBack(Inst, T))
             return {std::errc::operation_not_supported};
 
-        TransfoRegister.emplace(std::make_pair(Inst, SizeParam),
-                                std::move(NewValues));
-
-        replaceUses(Inst, InvertResult, T);
-
-        return TransfoRegister.at(std::make_pair(Inst, SizeParam));
+        return NewNode;
     }
 };
 }
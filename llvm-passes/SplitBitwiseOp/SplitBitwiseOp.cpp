@@ -12,6 +12,10 @@
 #include "llvm/Support/Debug.h"
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
@@ -19,13 +23,39 @@
 #include <numeric>
 #include <tuple>
 #include <map>
+#include <set>
 #include <cmath>
 #include <algorithm>
 
-#include "../PropagatedTransformation/PropagatedTransformation.hpp"
-
 using namespace llvm;
 
+#define DEBUG_TYPE "split-bitwise-op"
+
+#include "../PropagatedTransformation/PropagatedTransformation.hpp"
+#include "../ObfuscationUtils/Hotness.hpp"
+#include "../ObfuscationUtils/Pipeline.hpp"
+#include "../ObfuscationUtils/Random.hpp"
+#include "../ObfuscationUtils/Selection.hpp"
+
+STATISTIC(NumNoSplitSize, "Number of trees without any split size");
+STATISTIC(NumSplitPieces, "Number of pieces values are split into");
+STATISTIC(NumVectorTrees, "Number of trees split into vector lanes");
+STATISTIC(NumUnselected, "Number of functions left out by the selection");
+
+static cl::opt<unsigned> VectorRatio(
+    "split-vector-ratio",
+    cl::desc("Percentage of the trees whose values are split into the "
+             "shuffled lanes of a vector, each node becoming a single SIMD "
+             "operation, rather than into scalar pieces"),
+    cl::init(0));
+
+static cl::opt<bool> FunctionTrees(
+    "split-function-trees",
+    cl::desc("Build trees over the whole function, keeping values split "
+             "through phi nodes and across blocks: loop-carried values are "
+             "split before the loop and merged back after it"),
+    cl::init(false));
+
 namespace {
 
 std::set<unsigned> integerFactors(unsigned BitSize) {
@@ -44,66 +74,179 @@ std::set<unsigned> integerFactors(unsigned BitSize) {
 // PASS
 class SplitBitwiseOp
     : protected PropagatedTransformation::PropagatedTransformation,
-      public BasicBlockPass {
+      public FunctionPass {
 
     Type *OriginalType;
 
+    // Vector mode: operands are bitcast to <N x iSizeParam> and their lanes
+    // shuffled by LanePermutation. It is drawn once per function and number
+    // of lanes, so that lanes line up in a tree and split operands can be
+    // shared by the trees of the function.
+    bool VectorMode;
+    std::vector<uint32_t> LanePermutation;
+    std::map<unsigned, std::vector<uint32_t>> LanePermutations;
+
+    ObfuscationUtils::Selection Selection;
+
   public:
     static char ID;
 
-    SplitBitwiseOp() : BasicBlockPass(ID) {}
+    SplitBitwiseOp() : FunctionPass(ID), Selection("split") {}
 
-    virtual bool runOnBasicBlock(BasicBlock &BB) {
-        bool modified = false;
-
-        populateForest(BB);
+    bool doInitialization(Module &M) override {
+        Selection.reset(M);
+        return false;
+    }
 
-        for (auto const &T : Forest) {
-            const auto Roots = T.roots();
-            // Choosing SizeParam
-            SizeParam = chooseSplitSize(T);
-            // If there was no valid Size available:
-            if (SizeParam == 0) {
-                dbgs() << "split_binop: Couldn't pick split size.\n";
-                continue;
-            }
+    bool doFinalization(Module &M) override {
+        return ObfuscationUtils::Budget::finalize(M);
+    }
 
-            OriginalType = T.begin()->first->getType();
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        if (ObfuscationUtils::Hotness::enabled())
+            AU.addRequired<BlockFrequencyInfo>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        if (ObfuscationUtils::Budget::enabled())
+            AU.addRequired<TargetTransformInfo>();
+        AU.setPreservesCFG();
+    }
 
-            for (Instruction* Root : Roots) {
-                if (RecursiveTransform(Root, T, BB)) {
-                    modified = true;
-                }
-                else {
-                    dbgs() << "SplitBinOp: Obfuscation failed.\n";
-                    break;
-                }
-            }
+    bool runOnFunction(Function &F) override {
+        if (not Selection.isSelected(F)) {
+            ++NumUnselected;
+            return false;
         }
+
+        ObfuscationUtils::seedGenerator(Generator, DEBUG_TYPE, F);
+
+        Hotness.reset(ObfuscationUtils::Hotness::enabled()
+                          ? &getAnalysis<BlockFrequencyInfo>()
+                          : nullptr,
+                      F);
+        resetTransformations(
+            getAnalysis<DominatorTreeWrapperPass>().getDomTree());
+        LanePermutations.clear();
+        Budget.reset(ObfuscationUtils::Budget::enabled()
+                         ? &getAnalysis<TargetTransformInfo>()
+                         : nullptr,
+                     *F.getParent());
+
+        const bool modified = transformFunction(
+            F, FunctionTrees, [this]() { return splitForest(); });
 #ifndef NDEBUG
-        verifyFunction(*BB.getParent());
+        verifyFunction(F);
 #endif
         return modified;
     }
 
   private:
-    std::default_random_engine Generator;
+    // Every tree of the forest gets its split size and vector mode, hot
+    // trees getting the widest split size
+    bool splitForest() {
+        std::vector<std::pair<unsigned, bool>> Parameters(
+            Forest.size(), std::make_pair(0u, false));
+        return transformForest(
+            [&](unsigned Tree, Tree_t const &T, bool Hot) {
+                // Vector lanes first
+                SizeParam = chooseLaneSize(T, Hot);
+                VectorMode = SizeParam != 0;
+                if (not VectorMode)
+                    SizeParam = chooseSplitSize(T, Hot);
+                Parameters[Tree] = std::make_pair(SizeParam, VectorMode);
+                return SizeParam != 0;
+            },
+            [&](unsigned Tree, Tree_t const &T) {
+                std::tie(SizeParam, VectorMode) = Parameters[Tree];
+                return splitTree(T);
+            });
+    }
 
-    unsigned chooseSplitSize(Tree_t const &T) {
-        unsigned OriginalSize =
-            T.begin()->first->getType()->getIntegerBitWidth();
+    bool splitTree(Tree_t const &T) {
+        // If there was no valid Size available:
+        if (SizeParam == 0) {
+            DEBUG(dbgs() << "split_binop: Couldn't pick split size.\n");
+            ++NumNoSplitSize;
+            return false;
+        }
+
+        OriginalType = T.front()->getType();
+        const unsigned NumPieces =
+            OriginalType->getIntegerBitWidth() / SizeParam;
+        NumSplitPieces += NumPieces;
+
+        if (VectorMode) {
+            ++NumVectorTrees;
+            auto &Permutation = LanePermutations[NumPieces];
+            if (Permutation.empty()) {
+                Permutation.resize(NumPieces);
+                std::iota(Permutation.begin(), Permutation.end(), 0u);
+                std::shuffle(Permutation.begin(), Permutation.end(),
+                             Generator);
+            }
+            LanePermutation = Permutation;
+        }
+
+        if (not transformTree(T)) {
+            DEBUG(dbgs() << "SplitBinOp: Obfuscation failed.\n");
+            return false;
+        }
+        return true;
+    }
+
+    // Widest picks the widest split size still splitting the value, or the
+    // whole value when its size is prime
+    unsigned chooseSplitSize(Tree_t const &T, bool Widest) {
+        unsigned OriginalSize = T.front()->getType()->getIntegerBitWidth();
 
         std::set<unsigned> Factors = integerFactors(OriginalSize);
 
         if (Factors.empty())
             return 0;
 
+        if (Widest) {
+            auto Pos = Factors.crbegin();
+            if (Factors.size() > 2)
+                ++Pos;
+            return *Pos;
+        }
+
         std::uniform_int_distribution<unsigned> Rand(0, Factors.size() - 1);
         auto Pos = Factors.cbegin();
         std::advance(Pos, Rand(Generator));
         return *Pos;
     }
 
+    // Size of the vector lanes the values of T are split into, or 0 to split
+    // them into scalar pieces. Lanes are native integers, and there must be
+    // several of them. Widest picks the widest lanes.
+    unsigned chooseLaneSize(Tree_t const &T, bool Widest) {
+        std::uniform_int_distribution<unsigned> Percent(0, 99);
+        if (VectorRatio == 0 or Percent(Generator) >= VectorRatio)
+            return 0;
+
+        const unsigned OriginalSize =
+            T.front()->getType()->getIntegerBitWidth();
+        std::vector<unsigned> LaneSizes;
+        for (unsigned LaneSize : {8u, 16u, 32u, 64u})
+            if (LaneSize < OriginalSize and OriginalSize % LaneSize == 0)
+                LaneSizes.push_back(LaneSize);
+
+        if (LaneSizes.empty())
+            return 0;
+        if (Widest)
+            return LaneSizes.back();
+        std::uniform_int_distribution<size_t> Rand(0, LaneSizes.size() - 1);
+        return LaneSizes[Rand(Generator)];
+    }
+
+    // Shuffles the lanes of a vector with Mask
+    Value *shuffleLanes(Value *Vector, ArrayRef<uint32_t> Mask,
+                        IRBuilder<> &Builder) {
+        return Builder.CreateShuffleVector(
+            Vector, UndefValue::get(Vector->getType()),
+            ConstantDataVector::get(Vector->getContext(), Mask));
+    }
+
     BinaryOperator *isEligibleInstruction(Instruction *Inst) const override {
         if(BinaryOperator *Op = dyn_cast<BinaryOperator>(Inst)) {
             const Instruction::BinaryOps OpCode = Op->getOpcode();
@@ -129,6 +272,9 @@ class SplitBitwiseOp
         const unsigned NumberOperations = Operands1.size();
 
         Instruction::BinaryOps OpCode = Op->getOpcode();
+        if (VectorMode)
+            return {Builder.CreateBinOp(OpCode, Operands1[0], Operands2[0])};
+
         std::vector<Value *> NewResults(NumberOperations);
 
         auto Range = getShuffledRange(NumberOperations);
@@ -140,6 +286,65 @@ class SplitBitwiseOp
         return NewResults;
     }
 
+    // Scalar pieces and vector lanes of the same size are not interchangeable
+    unsigned encodingKey() const override {
+        return SizeParam * 2 + VectorMode;
+    }
+
+    std::vector<Type *> transformedTypes(Type *Ty) const override {
+        const unsigned NumberPieces = Ty->getIntegerBitWidth() / SizeParam;
+        Type *NewType = IntegerType::get(Ty->getContext(), SizeParam);
+        if (VectorMode)
+            return {VectorType::get(NewType, NumberPieces)};
+        return std::vector<Type *>(NumberPieces, NewType);
+    }
+
+    // Estimates follow the instructions emitted by transformOperand,
+    // applyNewOperation and transformBackOperand
+    ObfuscationUtils::Cost operandCost(Type *Ty) const override {
+        const unsigned NumberPieces = Ty->getIntegerBitWidth() / SizeParam;
+        if (VectorMode) {
+            Type *VectorTy = transformedTypes(Ty).front();
+            ObfuscationUtils::Cost C =
+                Budget.operation(Instruction::BitCast, VectorTy);
+            C += Budget.operation(Instruction::ShuffleVector, VectorTy);
+            return C;
+        }
+        ObfuscationUtils::Cost C;
+        for (unsigned Opcode : {Instruction::And, Instruction::LShr})
+            C += Budget.operation(Opcode, Ty, NumberPieces);
+        C += Budget.operation(Instruction::Trunc,
+                              IntegerType::get(Ty->getContext(), SizeParam),
+                              NumberPieces);
+        return C;
+    }
+
+    ObfuscationUtils::Cost nodeCost(Instruction const *Node) const override {
+        Type *Ty = Node->getType();
+        if (VectorMode)
+            return Budget.operation(Node->getOpcode(),
+                                    transformedTypes(Ty).front());
+        return Budget.operation(Node->getOpcode(),
+                                IntegerType::get(Ty->getContext(), SizeParam),
+                                Ty->getIntegerBitWidth() / SizeParam);
+    }
+
+    ObfuscationUtils::Cost backCost(Type *Ty) const override {
+        if (VectorMode) {
+            Type *VectorTy = transformedTypes(Ty).front();
+            ObfuscationUtils::Cost C =
+                Budget.operation(Instruction::ShuffleVector, VectorTy);
+            C += Budget.operation(Instruction::BitCast, Ty);
+            return C;
+        }
+        const unsigned NumberPieces = Ty->getIntegerBitWidth() / SizeParam;
+        ObfuscationUtils::Cost C;
+        for (unsigned Opcode : {Instruction::Shl, Instruction::Or})
+            C += Budget.operation(Opcode, Ty, NumberPieces);
+        C += Budget.operation(Instruction::ZExt, Ty, NumberPieces);
+        return C;
+    }
+
     std::vector<Value *> transformOperand(Value *Operand,
                                           IRBuilder<> &Builder) override {
         const unsigned OriginalNbBit = Operand->getType()->getIntegerBitWidth(),
@@ -148,6 +353,12 @@ class SplitBitwiseOp
 
         Type *NewType = IntegerType::get(Operand->getContext(), SplitSize);
 
+        if (VectorMode) {
+            Value *Lanes = Builder.CreateBitCast(
+                Operand, VectorType::get(NewType, NumberNewOperands));
+            return {shuffleLanes(Lanes, LanePermutation, Builder)};
+        }
+
         std::vector<Value *> NewOperands(NumberNewOperands);
 
         Value *InitMask = ConstantInt::get(Operand->getType(), -1);
@@ -171,6 +382,15 @@ class SplitBitwiseOp
         assert(Operands.size() && "Empty operand vector.");
         const unsigned NumberOperands = Operands.size(), SplitSize = SizeParam;
 
+        if (VectorMode) {
+            std::vector<uint32_t> InversePermutation(LanePermutation.size());
+            for (unsigned I = 0; I < LanePermutation.size(); ++I)
+                InversePermutation[LanePermutation[I]] = I;
+            return Builder.CreateBitCast(
+                shuffleLanes(Operands[0], InversePermutation, Builder),
+                OriginalType);
+        }
+
         Value *Accu = Constant::getNullValue(OriginalType);
 
         auto Range = getShuffledRange(NumberOperands);
@@ -191,11 +411,6 @@ char SplitBitwiseOp::ID = 0;
 static RegisterPass<SplitBitwiseOp> X("SplitBitwiseOp",
                                       "Splits bitwise operators", false, false);
 
-// register pass for clang use
-static void registerSplitBitwiseOpPass(const PassManagerBuilder &,
-                                       PassManagerBase &PM) {
-    PM.add(new SplitBitwiseOp());
-}
-static RegisterStandardPasses
-    RegisterSplitBitwisePass(PassManagerBuilder::EP_EarlyAsPossible,
-                    registerSplitBitwiseOpPass);
+// register pass for clang use, see -obf-placement
+static ObfuscationUtils::RegisterStandardObfuscation<SplitBitwiseOp>
+    RegisterSplitBitwisePass;
@@ -2,8 +2,19 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
@@ -16,68 +27,403 @@
 #include <numeric>
 #include <tuple>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <cmath>
 #include <algorithm>
-
-#include "../PropagatedTransformation/PropagatedTransformation.hpp"
+#include <iterator>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "x-or"
+
+#include "../PropagatedTransformation/PropagatedTransformation.hpp"
+#include "../ObfuscationUtils/Hotness.hpp"
+#include "../ObfuscationUtils/Pipeline.hpp"
+#include "../ObfuscationUtils/Random.hpp"
+#include "../ObfuscationUtils/Selection.hpp"
+
+STATISTIC(NumNoBase, "Number of trees without any eligible base");
+STATISTIC(NumSingleLimbBases, "Number of bases encoding into a single limb");
+STATISTIC(NumMultiLimbBases, "Number of bases encoding into several limbs");
+STATISTIC(NumEncodingTables, "Number of encoding tables emitted");
+STATISTIC(NumTreeCuts, "Number of nodes trees were cut at");
+STATISTIC(NumUnselected, "Number of functions left out by the selection");
+
+static cl::opt<unsigned> NativeBaseRatio(
+    "xor-native-base-ratio",
+    cl::desc("Percentage of trees whose base is restricted to the ones "
+             "encoding into a single legal integer (0 picks among all the "
+             "eligible bases)"),
+    cl::init(100));
+
+static cl::opt<unsigned> MaxLimbs(
+    "xor-max-limbs",
+    cl::desc("Cut trees so that their values encode into at most this many "
+             "limbs, decoding and encoding them again between the pieces (0 "
+             "only cuts the trees no base could encode)"),
+    cl::init(0));
+
+static cl::opt<bool> FunctionTrees(
+    "xor-function-trees",
+    cl::desc("Build trees over the whole function, keeping values encoded "
+             "through phi nodes and across blocks: accumulators of loops "
+             "with a small constant trip count stay encoded across "
+             "iterations and are decoded after the loop"),
+    cl::init(false));
+
+static cl::opt<unsigned> TableBits(
+    "xor-table-bits",
+    cl::desc("Encode operands this many bits at a time (up to 8), reading the "
+             "encoding of each chunk from a constant table (0 encodes them "
+             "bit by bit)"),
+    cl::init(0));
+
+static cl::opt<bool> PermuteTables(
+    "xor-permute-tables",
+    cl::desc("Store the entries of each encoding table in a random order, "
+             "drawn from -obf-seed and the table's parameters"),
+    cl::init(true));
+
 namespace {
-class X_OR : protected PropagatedTransformation::PropagatedTransformation,
-             public BasicBlockPass {
 
-    typedef std::map<std::pair<unsigned, unsigned>, std::map<unsigned, APInt>>
-        ExponentMaps_t;
-    ExponentMaps_t ExponentMaps;
+// Powers of the bases, Powers[Digit] being Base ** Digit, shared read-only by
+// every instance of the pass, including the ones of other threads
+class PowerTables {
+  public:
+    typedef std::vector<APInt> Powers_t;
+
+    static Powers_t const &get(unsigned Base, unsigned NbDigits,
+                               unsigned NewNbBit) {
+        static PowerTables Instance;
+        std::lock_guard<std::mutex> Guard(Instance.Lock);
+        auto &Table =
+            Instance.Tables[std::make_tuple(Base, NbDigits, NewNbBit)];
+        if (not Table) {
+            std::unique_ptr<Powers_t> Powers(new Powers_t());
+            Powers->reserve(NbDigits);
+            APInt Pow(NewNbBit, 1u), APBase(NewNbBit, Base);
+            for (unsigned Digit = 0; Digit < NbDigits; ++Digit) {
+                Powers->push_back(Pow);
+                Pow *= APBase;
+            }
+            Table = std::move(Powers);
+        }
+        // Tables are never modified nor freed once built
+        return *Table;
+    }
+
+  private:
+    std::mutex Lock;
+    std::map<std::tuple<unsigned, unsigned, unsigned>,
+             std::unique_ptr<Powers_t const>> Tables;
+};
+
+class X_OR : protected PropagatedTransformation::PropagatedTransformation,
+             public FunctionPass {
+
+    // Powers of the bases as constants of the limb types, by base, number
+    // of digits and limb type
+    std::map<std::tuple<unsigned, unsigned, Type *>, std::vector<Constant *>>
+        PowerConstants;
+
+    // Encodings of every value of a chunk of NbBits bits starting at digit
+    // First of a limb. The entry of chunk C is stored at index
+    // (C * Multiplier + Offset) mod 2 ** NbBits, an affine permutation.
+    struct EncodingTable {
+        GlobalVariable *Global;
+        uint64_t Multiplier, Offset;
+    };
+    // Tables of the current module, by base, first digit, number of bits and
+    // limb type
+    std::map<std::tuple<unsigned, unsigned, unsigned, Type *>, EncodingTable>
+        EncodingTables;
 
     Type *OriginalType;
 
+    // Target layout of the current module, may be null
+    const DataLayout *DL;
+
+    // Encoded values are split into limbs, each one holding a group of
+    // digits in an integer of at most LimbNbBit bits. Digits stay below the
+    // base, so adding limbs never carries from one limb into the next.
+    unsigned LimbNbBit = 64;
+
+    // Only set with function-level trees
+    LoopInfo *LI = nullptr;
+    ScalarEvolution *SE = nullptr;
+
+    ObfuscationUtils::Selection Selection;
+
   public:
     static char ID;
 
-    X_OR() : BasicBlockPass(ID) {}
+    X_OR() : FunctionPass(ID), Selection("xor") {}
 
-    virtual bool runOnBasicBlock(BasicBlock &BB) {
-        bool modified = false;
+    bool doInitialization(Module &M) override {
+        EncodingTables.clear();
+        Selection.reset(M);
+        return false;
+    }
 
-        populateForest(BB);
+    bool doFinalization(Module &M) override {
+        return ObfuscationUtils::Budget::finalize(M);
+    }
 
-        for (auto const &T : Forest) {
-            auto Roots = T.roots();
-            // Choosing NewBase
-            SizeParam = chooseTreeBase(T, Roots);
-            // If there was no valid base available:
-            if (SizeParam < 3) {
-                dbgs() << "X-OR: Couldn't pick base.\n";
-                continue;
-            }
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        if (ObfuscationUtils::Hotness::enabled())
+            AU.addRequired<BlockFrequencyInfo>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        if (ObfuscationUtils::Budget::enabled())
+            AU.addRequired<TargetTransformInfo>();
+        if (FunctionTrees) {
+            AU.addRequired<LoopInfo>();
+            AU.addRequired<ScalarEvolution>();
+        }
+        AU.setPreservesCFG();
+    }
 
-            OriginalType = T.begin()->first->getType();
+    bool runOnFunction(Function &F) override {
+        if (not Selection.isSelected(F)) {
+            ++NumUnselected;
+            return false;
+        }
 
-            for (auto Root : Roots) {
-                if (RecursiveTransform(Root, T, BB))
-                    modified = true;
-                else {
-                    dbgs() << "X_OR: Obfuscation failed.\n";
+        DL = F.getParent()->getDataLayout();
+        // Limbs are the widest legal integers, up to 64 bits
+        LimbNbBit = 64;
+        if (DL)
+            for (unsigned NbBit = 64; NbBit >= 8; NbBit /= 2)
+                if (DL->isLegalInteger(NbBit)) {
+                    LimbNbBit = NbBit;
                     break;
                 }
-            }
+        ObfuscationUtils::seedGenerator(Generator, DEBUG_TYPE, F);
+        Hotness.reset(ObfuscationUtils::Hotness::enabled()
+                          ? &getAnalysis<BlockFrequencyInfo>()
+                          : nullptr,
+                      F);
+        resetTransformations(
+            getAnalysis<DominatorTreeWrapperPass>().getDomTree());
+        Budget.reset(ObfuscationUtils::Budget::enabled()
+                         ? &getAnalysis<TargetTransformInfo>()
+                         : nullptr,
+                     *F.getParent());
+
+        if (FunctionTrees) {
+            LI = &getAnalysis<LoopInfo>();
+            SE = &getAnalysis<ScalarEvolution>();
         }
+        const bool modified = transformFunction(
+            F, FunctionTrees, [this]() { return obfuscateForest(); });
 #ifndef NDEBUG
-        verifyFunction(*BB.getParent());
+        verifyFunction(F);
 #endif
         return modified;
     }
 
   private:
-    // FIXME: capping at 128 bits because of APInt multiplication bug:
-    // https://llvm.org/bugs/show_bug.cgi?id=19797
-    const unsigned MaxSupportedSize = 128;
-    std::default_random_engine Generator;
+    // Larger bases would only spread values over more limbs
+    const unsigned MaxBase = 31;
+
+    // Every tree of the forest gets its base, once the trees too large for
+    // any allowed base are cut, hot trees getting the cheapest one
+    bool obfuscateForest() {
+        partitionForest();
+
+        std::vector<unsigned> Bases(Forest.size(), 0u);
+        return transformForest(
+            [&](unsigned Tree, Tree_t const &T, bool Hot) {
+                SizeParam = Bases[Tree] = chooseTreeBase(T, Hot);
+                return SizeParam >= 3;
+            },
+            [&](unsigned Tree, Tree_t const &T) {
+                return obfuscateTree(T, Bases[Tree]);
+            });
+    }
+
+    // Cuts trees whose digits would reach maxTreeBase(), at the heaviest
+    // operand of the nodes exceeding it. A cut node is decoded and encoded
+    // again, which brings each of its digits back to its parity. Digits of
+    // trees with phi nodes depend on trip counts: such trees are either left
+    // whole or, when their digits would grow too large over the iterations,
+    // cut at their phi nodes, loop-carried values being then decoded and
+    // encoded again each iteration.
+    void partitionForest() {
+        std::set<Value const *> PhiCuts;
+        for (auto const &T : Forest) {
+            const unsigned MaxEligibleBase =
+                maxTreeBase(T.front()->getType()->getIntegerBitWidth());
+            std::vector<Instruction *> Phis;
+            std::copy_if(T.nodes().begin(), T.nodes().end(),
+                         std::back_inserter(Phis), [](Instruction const *Node) {
+                             return isa<PHINode>(Node);
+                         });
+            if (Phis.empty() or
+                maxDigit(T, MaxEligibleBase) < MaxEligibleBase)
+                continue;
+            PhiCuts.insert(Phis.begin(), Phis.end());
+            NumTreeCuts += Phis.size();
+        }
+        if (not PhiCuts.empty())
+            cutForest(PhiCuts);
+
+        std::set<Value const *> Cuts;
+        for (auto const &T : Forest) {
+            if (std::any_of(T.nodes().begin(), T.nodes().end(),
+                            [](Instruction const *Node) {
+                                return isa<PHINode>(Node);
+                            }))
+                continue;
+            const unsigned Limit =
+                maxTreeBase(T.front()->getType()->getIntegerBitWidth()) - 1;
+            DenseMap<Value const *, unsigned> Digits;
+            auto DigitOf = [&](Value const *V) {
+                return T.contains(V) and not Cuts.count(V) ? Digits.lookup(V)
+                                                           : 1u;
+            };
+            for (Instruction *Node : T.nodes()) {
+                while (true) {
+                    unsigned Digit = 0;
+                    Value const *Heaviest = nullptr;
+                    for (auto const &Operand : Node->operands()) {
+                        Digit += DigitOf(Operand);
+                        if (DigitOf(Operand) > 1 and
+                            (not Heaviest or
+                             DigitOf(Operand) > DigitOf(Heaviest)))
+                            Heaviest = Operand;
+                    }
+                    if (Digit <= Limit or not Heaviest) {
+                        Digits[Node] = Digit;
+                        break;
+                    }
+                    Cuts.insert(Heaviest);
+                    ++NumTreeCuts;
+                }
+            }
+        }
+        if (not Cuts.empty())
+            cutForest(Cuts);
+    }
+
+    bool obfuscateTree(Tree_t const &T, unsigned Base) {
+        SizeParam = Base;
+        // If there was no valid base available:
+        if (SizeParam < 3) {
+            DEBUG(dbgs() << "X-OR: Couldn't pick base.\n");
+            ++NumNoBase;
+            return false;
+        }
+
+        OriginalType = T.front()->getType();
+        if (OriginalType->getIntegerBitWidth() <= digitsPerLimb(SizeParam))
+            ++NumSingleLimbBases;
+        else
+            ++NumMultiLimbBases;
+
+        if (not transformTree(T)) {
+            DEBUG(dbgs() << "X_OR: Obfuscation failed.\n");
+            return false;
+        }
+        return true;
+    }
+
+    // Number of iterations of the loop whose header holds Phi, 1 if Phi is
+    // not loop-carried and 0 if the trip count is unknown
+    unsigned tripCount(PHINode const *Phi) const {
+        BasicBlock const *BB = Phi->getParent();
+        Loop *L = LI->getLoopFor(BB);
+        if (not L or L->getHeader() != BB)
+            return 1;
+        BasicBlock *Exiting = L->getExitingBlock();
+        return Exiting ? SE->getSmallConstantTripCount(L, Exiting) : 0;
+    }
+
+    // Digits grow by at least one each iteration of a loop xoring into its
+    // accumulator, whose base must then exceed the trip count. Accumulators
+    // of other loops are decoded and encoded again each iteration, as are
+    // the ones whose digits grow faster (see partitionForest).
+    bool isEligiblePhi(PHINode *Phi) const override {
+        if (not Phi->getType()->isIntegerTy())
+            return false;
+        const unsigned TripCount = tripCount(Phi);
+        return TripCount != 0 and TripCount < MaxBase;
+    }
+
+    std::vector<Type *> transformedTypes(Type *Ty) const override {
+        return limbTypes(Ty->getContext(), Ty->getIntegerBitWidth(),
+                         SizeParam);
+    }
+
+    // Estimates follow the instructions emitted by transformOperand,
+    // applyNewOperation and transformBackOperand
+    ObfuscationUtils::Cost operandCost(Type *Ty) const override {
+        const unsigned OriginalNbBit = Ty->getIntegerBitWidth(),
+                       PerLimb = digitsPerLimb(SizeParam);
+        ObfuscationUtils::Cost C;
+        auto Types = limbTypes(Ty->getContext(), OriginalNbBit, SizeParam);
+        for (unsigned Limb = 0; Limb < Types.size(); ++Limb) {
+            const unsigned LimbDigits =
+                std::min(PerLimb, OriginalNbBit - Limb * PerLimb);
+            Type *LimbType = Types[Limb];
+            if (Limb)
+                C += Budget.operation(Instruction::LShr, Ty);
+            C += Budget.operation(Instruction::ZExt, LimbType);
+            if (not TableBits) {
+                for (unsigned Opcode : {Instruction::And, Instruction::LShr,
+                                        Instruction::Mul, Instruction::Add})
+                    C += Budget.operation(Opcode, LimbType, LimbDigits);
+                continue;
+            }
+            const unsigned ChunkBits = std::min<unsigned>(TableBits, 8),
+                           NbChunks = (LimbDigits + ChunkBits - 1) / ChunkBits;
+            std::vector<unsigned> Opcodes{Instruction::LShr, Instruction::And,
+                                          Instruction::ZExt,
+                                          Instruction::GetElementPtr,
+                                          Instruction::Load, Instruction::Add};
+            if (PermuteTables)
+                Opcodes.insert(Opcodes.end(), {Instruction::Mul,
+                                               Instruction::Add,
+                                               Instruction::And});
+            for (unsigned Opcode : Opcodes)
+                C += Budget.operation(Opcode, LimbType, NbChunks);
+        }
+        return C;
+    }
+
+    ObfuscationUtils::Cost nodeCost(Instruction const *Node) const override {
+        Type *Ty = Node->getType();
+        ObfuscationUtils::Cost C;
+        for (Type *LimbType :
+             limbTypes(Ty->getContext(), Ty->getIntegerBitWidth(), SizeParam))
+            C += Budget.operation(Instruction::Add, LimbType);
+        return C;
+    }
 
-    std::map<std::pair<unsigned, unsigned>, std::map<unsigned, APInt>>
-        ExponentMap;
+    ObfuscationUtils::Cost backCost(Type *Ty) const override {
+        const unsigned OriginalNbBit = Ty->getIntegerBitWidth(),
+                       PerLimb = digitsPerLimb(SizeParam);
+        ObfuscationUtils::Cost C;
+        auto Types = limbTypes(Ty->getContext(), OriginalNbBit, SizeParam);
+        for (unsigned Limb = 0; Limb < Types.size(); ++Limb) {
+            const unsigned LimbDigits =
+                std::min(PerLimb, OriginalNbBit - Limb * PerLimb);
+            Type *LimbType = Types[Limb];
+            for (unsigned Opcode :
+                 {Instruction::UDiv, Instruction::Mul, Instruction::Sub})
+                C += Budget.operation(Opcode, LimbType, LimbDigits - 1);
+            for (unsigned Opcode :
+                 {Instruction::And, Instruction::Shl, Instruction::Or})
+                C += Budget.operation(Opcode, LimbType, LimbDigits);
+            C += Budget.operation(Instruction::ZExt, Ty);
+            if (Limb) {
+                C += Budget.operation(Instruction::Shl, Ty);
+                C += Budget.operation(Instruction::Or, Ty);
+            }
+        }
+        return C;
+    }
 
     BinaryOperator *isEligibleInstruction(Instruction *Inst) const override {
         BinaryOperator *Op = dyn_cast<BinaryOperator>(Inst);
@@ -88,14 +434,19 @@ class X_OR : protected PropagatedTransformation::PropagatedTransformation,
         return nullptr;
     }
 
+    // Limbs are added one by one
     std::vector<Value *>
     applyNewOperation(std::vector<Value *> const &Operands1,
                       std::vector<Value *> const &Operands2, Instruction *,
                       IRBuilder<> &Builder) override {
-        assert(not Operands1.empty() and not Operands2.empty());
-
-        return std::vector<Value *>{
-            Builder.CreateAdd(Operands1[0], Operands2[0])};
+        assert(not Operands1.empty() and
+               Operands1.size() == Operands2.size());
+
+        std::vector<Value *> Limbs;
+        for (unsigned Limb = 0; Limb < Operands1.size(); ++Limb)
+            Limbs.push_back(
+                Builder.CreateAdd(Operands1[Limb], Operands2[Limb]));
+        return Limbs;
     }
 
     std::vector<Value *> transformOperand(Value *Operand,
@@ -104,132 +455,334 @@ class X_OR : protected PropagatedTransformation::PropagatedTransformation,
             return std::vector<Value *>();
 
         const unsigned OriginalNbBit = Operand->getType()->getIntegerBitWidth(),
-                       Base = SizeParam,
-                       NewNbBit = requiredBits(OriginalNbBit, Base);
+                       Base = SizeParam, PerLimb = digitsPerLimb(Base);
 
-        if (not NewNbBit) {
+        auto Types = limbTypes(Operand->getContext(), OriginalNbBit, Base);
+        if (Types.empty()) {
             return std::vector<Value *>();
         }
 
-        Type *NewBaseType = IntegerType::get(Operand->getContext(), NewNbBit);
-
-        auto const &ExpoMap = getExponentMap(Base, OriginalNbBit, NewBaseType);
+        // Initializing variables: the bits of each limb, moved to the low
+        // bits of the limb's type
+        std::vector<Value *> Bits;
+        for (unsigned Limb = 0; Limb < Types.size(); ++Limb) {
+            Value *Shifted =
+                Limb ? Builder.CreateLShr(Operand, Limb * PerLimb) : Operand;
+            Bits.push_back(Builder.CreateZExtOrTrunc(Shifted, Types[Limb]));
+        }
 
-        // Initializing variables
-        Value *Accu = Constant::getNullValue(NewBaseType),
-              *InitMask = ConstantInt::get(NewBaseType, 1u);
+        if (TableBits)
+            return transformOperandByChunks(Bits, OriginalNbBit, Builder);
 
-        // Extending the original value to NewNbBit for bitwise and
-        Value *ExtendedOperand = Builder.CreateZExt(Operand, NewBaseType);
+        std::vector<Value *> Limbs;
+        std::vector<std::vector<Constant *> const *> Powers;
+        for (unsigned Limb = 0; Limb < Types.size(); ++Limb) {
+            Limbs.push_back(Constant::getNullValue(Types[Limb]));
+            Powers.push_back(&getPowers(
+                Base, std::min(PerLimb, OriginalNbBit - Limb * PerLimb),
+                Types[Limb]));
+        }
 
         auto Range = getShuffledRange(OriginalNbBit);
 
         for (auto Bit : Range) {
-            Value *Mask = Builder.CreateShl(InitMask, Bit);
-            Value *MaskedNewValue = Builder.CreateAnd(ExtendedOperand, Mask);
-            Value *BitValue = Builder.CreateLShr(MaskedNewValue, Bit);
-            Value *Expo = ConstantInt::get(NewBaseType, ExpoMap.at(Bit));
+            const unsigned Limb = Bit / PerLimb, Digit = Bit % PerLimb;
+            Value *Mask = ConstantInt::get(Types[Limb], 1u);
+            Mask = Builder.CreateShl(Mask, Digit);
+            Value *MaskedNewValue = Builder.CreateAnd(Bits[Limb], Mask);
+            Value *BitValue = Builder.CreateLShr(MaskedNewValue, Digit);
+            Value *Expo = (*Powers[Limb])[Digit];
             Value *NewBit = Builder.CreateMul(BitValue, Expo);
-            Accu = Builder.CreateAdd(Accu, NewBit);
+            Limbs[Limb] = Builder.CreateAdd(Limbs[Limb], NewBit);
+        }
+        return Limbs;
+    }
+
+    // Encodes the limbs a chunk of TableBits bits at a time, the encoding of
+    // a chunk being read from a table instead of computed bit by bit
+    std::vector<Value *>
+    transformOperandByChunks(std::vector<Value *> const &Bits,
+                             unsigned OriginalNbBit, IRBuilder<> &Builder) {
+        const unsigned Base = SizeParam, PerLimb = digitsPerLimb(Base),
+                       ChunkBits = std::min<unsigned>(TableBits, 8);
+        Module &M = *Builder.GetInsertBlock()->getParent()->getParent();
+
+        // Chunks, as (limb, first digit) pairs
+        std::vector<std::pair<unsigned, unsigned>> Chunks;
+        std::vector<Value *> Limbs;
+        for (unsigned Limb = 0; Limb < Bits.size(); ++Limb) {
+            const unsigned LimbDigits =
+                std::min(PerLimb, OriginalNbBit - Limb * PerLimb);
+            for (unsigned First = 0; First < LimbDigits; First += ChunkBits)
+                Chunks.emplace_back(Limb, First);
+            Limbs.push_back(Constant::getNullValue(Bits[Limb]->getType()));
+        }
+
+        auto Range = getShuffledRange(Chunks.size());
+
+        for (auto I : Range) {
+            unsigned Limb, First;
+            std::tie(Limb, First) = Chunks[I];
+            Type *LimbType = Bits[Limb]->getType();
+            const unsigned NbBits = std::min(
+                ChunkBits,
+                std::min(PerLimb, OriginalNbBit - Limb * PerLimb) - First);
+            auto const &Table =
+                getEncodingTable(M, Base, First, NbBits, LimbType);
+            Value *Mask = ConstantInt::get(LimbType, (1u << NbBits) - 1);
+
+            Value *Index = Builder.CreateLShr(Bits[Limb], First);
+            Index = Builder.CreateAnd(Index, Mask);
+            if (Table.Multiplier != 1 or Table.Offset) {
+                Index = Builder.CreateMul(
+                    Index, ConstantInt::get(LimbType, Table.Multiplier));
+                Index = Builder.CreateAdd(
+                    Index, ConstantInt::get(LimbType, Table.Offset));
+                Index = Builder.CreateAnd(Index, Mask);
+            }
+            // Indices are signed, zero-extending the chunk keeps it positive
+            Index = Builder.CreateZExt(Index, Builder.getInt64Ty());
+            Value *Indices[] = {Builder.getInt64(0), Index};
+            Value *Entry = Builder.CreateInBoundsGEP(Table.Global, Indices);
+            Limbs[Limb] =
+                Builder.CreateAdd(Limbs[Limb], Builder.CreateLoad(Entry));
+        }
+        return Limbs;
+    }
+
+    EncodingTable const &getEncodingTable(Module &M, unsigned Base,
+                                          unsigned First, unsigned NbBits,
+                                          Type *LimbType) {
+        auto Key = std::make_tuple(Base, First, NbBits, LimbType);
+        auto Found = EncodingTables.find(Key);
+        if (Found != EncodingTables.end())
+            return Found->second;
+
+        const uint64_t Size = uint64_t(1) << NbBits;
+        const unsigned LimbNbBit = LimbType->getIntegerBitWidth();
+        EncodingTable Table{nullptr, 1u, 0u};
+        // Whichever function builds the table first, the permutation and the
+        // choices made for the function stay the same: the permutation has
+        // its own stream, specific to the table
+        if (PermuteTables) {
+            std::default_random_engine TableGenerator;
+            ObfuscationUtils::seedGenerator(
+                TableGenerator, DEBUG_TYPE " table",
+                (Twine(Base) + "." + Twine(First) + "." + Twine(NbBits) +
+                 "." + Twine(LimbNbBit))
+                    .str());
+            std::uniform_int_distribution<uint64_t> Rand(0, Size - 1);
+            // Odd multipliers are invertible modulo a power of two
+            Table.Multiplier = Rand(TableGenerator) | 1u;
+            Table.Offset = Rand(TableGenerator);
+        }
+
+        auto const &Powers = PowerTables::get(Base, First + NbBits, LimbNbBit);
+        std::vector<Constant *> Entries(Size);
+        for (uint64_t Chunk = 0; Chunk < Size; ++Chunk) {
+            APInt Entry(LimbNbBit, 0u);
+            for (unsigned Bit = 0; Bit < NbBits; ++Bit)
+                if ((Chunk >> Bit) & 1u)
+                    Entry += Powers[First + Bit];
+            Entries[(Chunk * Table.Multiplier + Table.Offset) & (Size - 1)] =
+                ConstantInt::get(LimbType, Entry);
         }
-        return std::vector<Value *>{Accu};
+
+        ArrayType *TableType = ArrayType::get(LimbType, Size);
+        Table.Global = new GlobalVariable(
+            M, TableType, true, GlobalValue::PrivateLinkage,
+            ConstantArray::get(TableType, Entries), "xor.table");
+        Table.Global->setUnnamedAddr(true);
+        ++NumEncodingTables;
+        return EncodingTables.emplace(Key, Table).first->second;
     }
 
+    // Digits are peeled off each limb from the lowest one: the quotient of a
+    // limb by the base holds the digits left, and the remainder the current
+    // digit, whose parity is the original bit. The backend turns divisions
+    // by the constant base into multiplications by its reciprocal.
     Value *transformBackOperand(std::vector<Value *> const &Operands,
                                 IRBuilder<> &Builder) override {
         assert(Operands.size() && "No instructions provided.");
-        Value *Operand = Operands[0];
-
-        Type *ObfuscatedType = Operand->getType();
 
         const unsigned OriginalNbBit = OriginalType->getIntegerBitWidth(),
-                       Base = SizeParam;
+                       Base = SizeParam, PerLimb = digitsPerLimb(Base);
 
-        // Initializing variables
-        Value *IR2 = ConstantInt::get(ObfuscatedType, 2u),
-              *IRBase = ConstantInt::get(ObfuscatedType, Base),
-              *Accu = Constant::getNullValue(ObfuscatedType);
-
-        auto const &ExpoMap =
-            getExponentMap(Base, OriginalNbBit, ObfuscatedType);
+        // Initializing variables: the digits left in each limb
+        std::vector<Value *> Limbs, Left(Operands);
+        std::vector<unsigned> NextDigits(Operands.size(), 0u);
+        for (Value *Operand : Operands)
+            Limbs.push_back(Constant::getNullValue(Operand->getType()));
 
+        // Limbs are peeled in turn, in random order
         auto Range = getShuffledRange(OriginalNbBit);
 
         for (auto Bit : Range) {
-            Value *Pow = ConstantInt::get(ObfuscatedType, ExpoMap.at(Bit));
-            Value *Q = Builder.CreateUDiv(Operand, Pow);
-            Q = Builder.CreateURem(Q, IRBase);
-            Q = Builder.CreateURem(Q, IR2);
-            Value *ShiftedBit = Builder.CreateShl(Q, Bit);
-            Accu = Builder.CreateOr(Accu, ShiftedBit);
+            const unsigned Limb = Bit / PerLimb, Digit = NextDigits[Limb]++;
+            const unsigned LimbDigits =
+                std::min(PerLimb, OriginalNbBit - Limb * PerLimb);
+            Type *LimbType = Left[Limb]->getType();
+            Value *R = Left[Limb];
+            // The last digit of a limb is all there is left
+            if (Digit + 1 < LimbDigits) {
+                Value *IRBase = ConstantInt::get(LimbType, Base);
+                Value *Q = Builder.CreateUDiv(Left[Limb], IRBase);
+                R = Builder.CreateSub(Left[Limb], Builder.CreateMul(Q, IRBase));
+                Left[Limb] = Q;
+            }
+            R = Builder.CreateAnd(R, ConstantInt::get(LimbType, 1u));
+            Value *ShiftedBit = Builder.CreateShl(R, Digit);
+            Limbs[Limb] = Builder.CreateOr(Limbs[Limb], ShiftedBit);
         }
-        // Cast back to original type
-        return Builder.CreateTrunc(Accu, OriginalType);
+
+        // Cast back to original type, putting the limbs' bits together
+        Value *Accu = Builder.CreateZExtOrTrunc(Limbs[0], OriginalType);
+        for (unsigned Limb = 1; Limb < Limbs.size(); ++Limb) {
+            Value *LimbBits =
+                Builder.CreateZExtOrTrunc(Limbs[Limb], OriginalType);
+            LimbBits = Builder.CreateShl(LimbBits, Limb * PerLimb);
+            Accu = Builder.CreateOr(Accu, LimbBits);
+        }
+        return Accu;
     }
 
-    unsigned chooseTreeBase(Tree_t const &T, Tree_t::mapped_type const &Roots) {
+    // Cheapest picks the smallest eligible base, which has the narrowest
+    // encoding
+    unsigned chooseTreeBase(Tree_t const &T, bool Cheapest) {
         assert(T.size() && "Can't process an empty tree.");
-        unsigned Max = maxBase(
-                     T.begin()->first->getType()->getIntegerBitWidth()),
-                 MinEligibleBase = 0;
-
-        // Computing minimum base
-        // Each node of the tree has a base equal to the sum of its two
-        // successors' min base
-        std::map<Value *, unsigned> NodeBaseMap;
-        for (auto const &Root : Roots)
-            MinEligibleBase = std::max(minimalBase(Root, T, NodeBaseMap), MinEligibleBase);
-
-        ++MinEligibleBase;
-        if (MinEligibleBase < 3 or MinEligibleBase > Max)
+
+        // Computing minimum base, the largest digit of the tree plus one
+        const unsigned MaxEligibleBase =
+            maxTreeBase(T.front()->getType()->getIntegerBitWidth());
+        const unsigned MinEligibleBase = maxDigit(T, MaxEligibleBase) + 1;
+        if (MinEligibleBase < 3 or MinEligibleBase > MaxEligibleBase)
             return 0;
-        std::uniform_int_distribution<unsigned> Rand(MinEligibleBase, Max);
+        if (Cheapest)
+            return MinEligibleBase;
+
+        // Preferring bases whose encoding fits in a single limb, as fewer
+        // limbs mean fewer instructions
+        std::uniform_int_distribution<unsigned> Percent(0, 99);
+        if (Percent(Generator) < NativeBaseRatio) {
+            const unsigned SingleLimbMax = maxSingleLimbBase(
+                T.front()->getType()->getIntegerBitWidth(), MinEligibleBase);
+            if (SingleLimbMax) {
+                std::uniform_int_distribution<unsigned> Rand(MinEligibleBase,
+                                                             SingleLimbMax);
+                return Rand(Generator);
+            }
+        }
+        std::uniform_int_distribution<unsigned> Rand(MinEligibleBase,
+                                                     MaxEligibleBase);
         return Rand(Generator);
     }
 
-    unsigned minimalBase(Value *Node, Tree_t const &T,
-                         std::map<Value *, unsigned> &NodeBaseMap) {
-        // Emplace new value and check if already passed this node
-        if (NodeBaseMap[Node] != 0)
-            return NodeBaseMap.at(Node);
-        Instruction *Inst = dyn_cast<Instruction>(Node);
-        // We reached a leaf
-        if (not Inst or T.find(Inst) == T.end()) {
-            NodeBaseMap.at(Node) = 1;
-            return 1;
-        } else {
-            // Recursively check operands
-            unsigned sum = 0;
-            for (auto const &Operand : Inst->operands()) {
-                if (NodeBaseMap[Operand] == 0)
-                    minimalBase(Operand, T, NodeBaseMap);
-                sum += NodeBaseMap.at(Operand);
-            }
-            // Compute this node's min base
-            NodeBaseMap[Node] = sum;
-            return sum;
+    // Largest base allowed for a tree of OriginalNbBit-bit values: MaxBase,
+    // or the largest one encoding into at most MaxLimbs limbs. Types too
+    // wide for any base to fit are only bounded by MaxBase.
+    unsigned maxTreeBase(unsigned OriginalNbBit) const {
+        if (not MaxLimbs)
+            return MaxBase;
+        for (unsigned Base = MaxBase; Base >= 3; --Base) {
+            const unsigned PerLimb = digitsPerLimb(Base);
+            if ((OriginalNbBit + PerLimb - 1) / PerLimb <= MaxLimbs)
+                return Base;
         }
+        return MaxBase;
     }
 
-    // Returns the max supported base for the given OriginalNbBit
-    // 31 is the max base to avoid overflow 2**sizeof(unsigned) in requiredBits
-    unsigned maxBase(unsigned OriginalNbBit) {
-        assert(OriginalNbBit && "Bisize must be > 1");
-        const unsigned MaxSupportedBase = sizeof(unsigned) * 8 - 1;
-        if (OriginalNbBit >= MaxSupportedSize)
-            return 0;
-        if (MaxSupportedSize / OriginalNbBit > MaxSupportedBase)
-            return MaxSupportedBase;
-        return unsigned(2) << ((MaxSupportedSize / OriginalNbBit) - 1);
+    // Returns the largest base in [MinBase, MaxBase] whose encoding fits in a
+    // single limb, 0 if there is none
+    unsigned maxSingleLimbBase(unsigned OriginalNbBit, unsigned MinBase) const {
+        unsigned SingleLimbMax = 0;
+        // Limbs hold fewer digits as the base grows
+        for (unsigned Base = MinBase; Base <= MaxBase; ++Base) {
+            if (digitsPerLimb(Base) < OriginalNbBit)
+                break;
+            SingleLimbMax = Base;
+        }
+        return SingleLimbMax;
     }
 
-    // numbers of bits required to store the original type in the new base
+    // Number of digits in base Base a limb holds
+    unsigned digitsPerLimb(unsigned Base) const {
+        unsigned NbDigits = 1;
+        while (requiredBits(NbDigits + 1, Base) <= LimbNbBit)
+            ++NbDigits;
+        return NbDigits;
+    }
+
+    // Types of the limbs encoding an OriginalNbBit-bit value in Base, limb I
+    // holding the digits from I * digitsPerLimb(Base) on. Empty if Base is
+    // not supported.
+    std::vector<Type *> limbTypes(LLVMContext &Context, unsigned OriginalNbBit,
+                                  unsigned Base) const {
+        std::vector<Type *> Types;
+        if (Base < 3 or Base > MaxBase)
+            return Types;
+        const unsigned PerLimb = digitsPerLimb(Base);
+        for (unsigned First = 0; First < OriginalNbBit; First += PerLimb)
+            Types.push_back(encodedType(
+                Context,
+                requiredBits(std::min(PerLimb, OriginalNbBit - First), Base)));
+        return Types;
+    }
+
+    // Encoded values which fit in a legal integer use its whole width so
+    // that the backend doesn't have to promote them
+    Type *encodedType(LLVMContext &Context, unsigned NewNbBit) const {
+        if (DL and DL->fitsInLegalInteger(NewNbBit))
+            return DL->getSmallestLegalIntType(Context, NewNbBit);
+        return IntegerType::get(Context, NewNbBit);
+    }
+
+    // Largest digit the encoded values of T can hold: a leaf holds 1 per
+    // digit, a xor node the sum of its operands' digits and a phi node the
+    // largest of its incoming values' digits. Nodes are visited in tree
+    // order, and with phi nodes the visit is repeated once per iteration of
+    // their loops, until the digits settle. Returns Limit as soon as a digit
+    // reaches it.
+    unsigned maxDigit(Tree_t const &T, unsigned Limit) const {
+        // Number of visits covering every iteration, for loops nested or not
+        std::set<BasicBlock const *> Headers;
+        uint64_t Rounds = 1;
+        for (Instruction *Node : T.nodes())
+            if (PHINode *Phi = dyn_cast<PHINode>(Node))
+                if (Headers.insert(Phi->getParent()).second)
+                    Rounds = std::min<uint64_t>(Rounds * tripCount(Phi), Limit);
+
+        DenseMap<Value const *, unsigned> Digits;
+        auto DigitOf = [&](Value const *V) {
+            return T.contains(V) ? Digits.lookup(V) : 1u;
+        };
+        unsigned Max = 0;
+        for (uint64_t Round = 0; Round < Rounds; ++Round) {
+            bool Changed = false;
+            for (Instruction *Node : T.nodes()) {
+                unsigned Digit = 0;
+                for (auto const &Operand : Node->operands())
+                    Digit = isa<PHINode>(Node)
+                                ? std::max(Digit, DigitOf(Operand))
+                                : Digit + DigitOf(Operand);
+                if (Digit >= Limit)
+                    return Limit;
+                unsigned &Current = Digits[Node];
+                Changed |= Digit != Current;
+                Current = Digit;
+                Max = std::max(Max, Digit);
+            }
+            if (not Changed)
+                break;
+        }
+        return Max;
+    }
+
+    // numbers of bits required to store OriginalSize digits in the new base
     // Can hold up to twice the max of the original type to store the max result
     // of the add
-    // returns 0 if more than 128 bits are needed
     unsigned requiredBits(unsigned OriginalSize, unsigned TargetBase) const {
         assert(OriginalSize);
-        if (TargetBase <= 2 or OriginalSize >= MaxSupportedSize)
+        if (TargetBase <= 2)
             return 0;
         // 'Exact' formula : std::ceil(std::log2(std::pow(TargetBase,
         // OriginalSize) - 1));
@@ -237,26 +790,22 @@ class X_OR : protected PropagatedTransformation::PropagatedTransformation,
             (unsigned)std::ceil(OriginalSize * std::log2(TargetBase));
         // Need to make sure that the base can be represented too...
         // (For instance for 2 chained boolean xor)
-        ret = std::max(ret, (unsigned)std::floor(std::log2(TargetBase)) + 1);
-        return ret <= MaxSupportedSize ? ret : 0;
+        return std::max(ret, (unsigned)std::floor(std::log2(TargetBase)) + 1);
     }
 
-    ExponentMaps_t::mapped_type
-    getExponentMap(unsigned Base, unsigned OriginalNbBit, const Type *Ty) {
-        // Eplacing if the pair doesn't exist, else return an iter to the
-        // existing
-        auto Position = ExponentMaps.emplace(
-            std::make_pair(Base, OriginalNbBit), std::map<unsigned, APInt>());
-        // If the map has not been computed yet
-        if (Position.second) {
-            unsigned NewNbBit = Ty->getIntegerBitWidth();
-            APInt Pow(NewNbBit, 1u), APBase(NewNbBit, Base);
-            for (unsigned Bit = 0; Bit < OriginalNbBit; ++Bit) {
-                ExponentMaps.at(Position.first->first).emplace(Bit, Pow);
-                Pow *= APBase;
-            }
+    // Constants are created once per pass instance, the shared tables
+    // being only locked then
+    std::vector<Constant *> const &getPowers(unsigned Base, unsigned NbDigits,
+                                             Type *Ty) {
+        auto &Constants = PowerConstants[std::make_tuple(Base, NbDigits, Ty)];
+        if (Constants.empty()) {
+            auto const &Powers =
+                PowerTables::get(Base, NbDigits, Ty->getIntegerBitWidth());
+            Constants.reserve(Powers.size());
+            for (auto const &Pow : Powers)
+                Constants.push_back(ConstantInt::get(Ty, Pow));
         }
-        return Position.first->second;
+        return Constants;
     }
 };
 }
@@ -264,9 +813,5 @@ class X_OR : protected PropagatedTransformation::PropagatedTransformation,
 char X_OR::ID = 0;
 static RegisterPass<X_OR> X("X-OR", "Obfuscates XORs", false, false);
 
-// register pass for clang use
-static void registerX_ORPass(const PassManagerBuilder &, PassManagerBase &PM) {
-    PM.add(new X_OR());
-}
-static RegisterStandardPasses
-    RegisterX_ORPass(PassManagerBuilder::EP_EarlyAsPossible, registerX_ORPass);
+// register pass for clang use, see -obf-placement
+static ObfuscationUtils::RegisterStandardObfuscation<X_OR> RegisterX_ORPass;
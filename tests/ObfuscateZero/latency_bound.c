@@ -0,0 +1,8 @@
+// RUN: clang -Xclang -load -Xclang LLVMObfuscateZero.so -mllvm -zero-max-added-latency=0 %s -S -emit-llvm -O2 -o %t1.ll
+// RUN: test `grep -c ' ret i32 0' %t1.ll` = 1
+// RUN: clang -Xclang -load -Xclang LLVMObfuscateZero.so %s -S -emit-llvm -O2 -o %t2.ll
+// RUN: test `grep -c ' ret i32 0' %t2.ll` = 0
+
+int main(int argc, char *argv[]) {
+    return 0;
+}
@@ -0,0 +1,16 @@
+// RUN: clang -Xclang -load -Xclang LLVMObfuscateZero.so -mllvm -zero-pool-size=1 -mllvm -zero-max-added-latency=100 %s -S -emit-llvm -O0 -o %t1.ll
+// RUN: test `grep -c ' icmp eq i32 ' %t1.ll` = 1
+// RUN: clang -Xclang -load -Xclang LLVMObfuscateZero.so -mllvm -zero-pool-size=2 -mllvm -zero-pool-scope=function -mllvm -zero-pool-mix %s -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out 10` = `%t3.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+    int a = atoi(argv[1]);
+    int b = a - 0;
+    int c = (a | 0) + (b ^ 0);
+
+    printf("%d\n", c);
+    return 0;
+}
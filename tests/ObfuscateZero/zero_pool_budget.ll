@@ -0,0 +1,26 @@
+;; RUN: opt -load LLVMObfuscateZero.so -ObfuscateZero -zero-pool-size=16 -zero-max-added-latency=100 -obf-size-budget=100 %s -S -o %t1.ll
+;; The function may double in size, which leaves room for a single opaque
+;; predicate: the pool is not filled beyond it
+;; RUN: test `grep -c ' icmp eq ' %t1.ll` = 1
+;; RUN: opt -load LLVMObfuscateZero.so -ObfuscateZero -zero-pool-size=16 -zero-max-added-latency=100 %s -S -o %t2.ll
+;; RUN: test `grep -c ' icmp eq ' %t2.ll` = 16
+
+define i32 @sum(i32 %a, i32 %b) {
+  %1 = add i32 %a, %b
+  %2 = add i32 %1, %b
+  %3 = add i32 %2, %b
+  %4 = add i32 %3, %b
+  %5 = add i32 %4, %b
+  %6 = add i32 %5, %b
+  %7 = add i32 %6, %b
+  %8 = add i32 %7, %b
+  %9 = add i32 %8, %b
+  %10 = add i32 %9, %b
+  %11 = add i32 %10, %b
+  %12 = add i32 %11, %b
+  %13 = add i32 %12, %b
+  %14 = add i32 %13, %b
+  %15 = add i32 %14, %b
+  %16 = or i32 %15, 0
+  ret i32 %16
+}
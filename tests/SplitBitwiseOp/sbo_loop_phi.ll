@@ -0,0 +1,23 @@
+;; RUN: opt -load LLVMSplitBitwiseOp.so -SplitBitwiseOp -split-function-trees -split-vector-ratio=100 %s -S -o %t1.ll
+;; %x is split in the entry block, %k in the loop, %h2 is merged back in the exit block only
+;; RUN: test `grep -c ' shufflevector ' %t1.ll` = 3
+;; RUN: test `sed -n '/^loop:/,/^exit:/p' %t1.ll | grep -c ' shufflevector '` = 1
+;; RUN: test `sed -n '/^exit:/,/^}/p' %t1.ll | grep -c ' shufflevector '` = 1
+;; RUN: test `grep -c ' phi <2 x i8> ' %t1.ll` = 1
+
+define i16 @rounds(i16 %x, i16 %k, i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %h = phi i16 [ %x, %entry ], [ %h2, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i2, %loop ]
+  %h1 = xor i16 %h, %k
+  %h2 = and i16 %h1, 4095
+  %i2 = add i32 %i, 1
+  %c = icmp ult i32 %i2, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i16 %h2
+}
@@ -0,0 +1,18 @@
+;; RUN: opt -load LLVMSplitBitwiseOp.so -SplitBitwiseOp -split-vector-ratio=100 %s -S -o %t1.ll
+;; %k is split once, in the entry block, and reused by the tree of %then
+;; RUN: test `grep -c ' shufflevector ' %t1.ll` = 5
+;; RUN: test `sed -n '/^then:/,/^exit:/p' %t1.ll | grep -c ' shufflevector '` = 2
+
+define i16 @shared(i16 %a, i16 %b, i16 %k, i1 %c) {
+entry:
+  %1 = xor i16 %a, %k
+  br i1 %c, label %then, label %exit
+
+then:
+  %2 = xor i16 %b, %k
+  br label %exit
+
+exit:
+  %r = phi i16 [ %1, %entry ], [ %2, %then ]
+  ret i16 %r
+}
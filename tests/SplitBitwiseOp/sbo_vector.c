@@ -0,0 +1,14 @@
+// RUN: clang -Xclang -load -Xclang LLVMSplitBitwiseOp.so -mllvm -split-vector-ratio=100 %s -S -emit-llvm -O0 -o %t1.ll
+// RUN: test `grep -c ' shufflevector ' %t1.ll` -ge 4
+// RUN: test `grep -c ' xor <' %t1.ll` = 2
+// RUN: clang -Xclang -load -Xclang LLVMSplitBitwiseOp.so -mllvm -split-vector-ratio=100 %s -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out` = `%t3.out`
+#include <stdio.h>
+#include <stdint.h>
+
+int main() {
+    volatile uint64_t a = 0x0123456789abcdefULL, b = -1, c = 0xf0f0f0f0f0f0f0f0ULL;
+    printf("%llu\n", (unsigned long long)((a ^ b) ^ c));
+    return 0;
+}
@@ -0,0 +1,24 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so %s -S -emit-llvm -O2 -o %t1.ll
+// Only the annotated function is obfuscated
+// RUN: test `sed -n '/@protect(/,/^}/p' %t1.ll | grep -c ' xor '` = 0
+// RUN: test `sed -n '/@plain(/,/^}/p' %t1.ll | grep -c ' xor '` = 1
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so %s -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out 10` = `%t3.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+
+__attribute__((noinline, annotate("obf:xor,split")))
+unsigned protect(unsigned a, unsigned b, unsigned c) {
+    return (a ^ b) ^ c;
+}
+
+__attribute__((noinline)) unsigned plain(unsigned a, unsigned b) {
+    return a ^ b;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned a = atoi(argv[1]);
+    printf("%u %u\n", protect(a, 0x1234, 0xdead), plain(a, 42));
+    return 0;
+}
@@ -0,0 +1,14 @@
+;; RUN: opt -load LLVMX-OR.so -X-OR -obf-size-budget=1 %s -S -o %t1.ll
+;; A tree costs far more than 1% of the module: nothing is transformed
+;; RUN: test `grep -c ' xor ' %t1.ll` = 3
+;; The accounts kept in the module metadata are dropped once done
+;; RUN: test `grep -c '^!obf.budget = ' %t1.ll` = 0
+;; RUN: opt -load LLVMX-OR.so -X-OR -obf-size-budget=100000 %s -S -o %t2.ll
+;; RUN: test `grep -c ' xor ' %t2.ll` = 0
+
+define i8 @chain(i8 %a, i8 %b, i8 %c, i8 %d) {
+  %1 = xor i8 %a, %b
+  %2 = xor i8 %1, %c
+  %3 = xor i8 %2, %d
+  ret i8 %3
+}
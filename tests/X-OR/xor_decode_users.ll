@@ -0,0 +1,20 @@
+;; RUN: opt -load LLVMX-OR.so -X-OR %s -S -o %t1.ll
+;; RUN: test `grep -c ' xor ' %t1.ll` = 5
+;; Only @chain's root and @shared's two nodes are converted back, peeling
+;; 8 digits with 7 divisions each
+;; RUN: test `grep -c ' udiv ' %t1.ll` = 21
+;; RUN: test `grep -c ' urem ' %t1.ll` = 0
+
+define i8 @chain(i8 %a, i8 %b, i8 %c, i8 %d) {
+  %1 = xor i8 %a, %b
+  %2 = xor i8 %1, %c
+  %3 = xor i8 %2, %d
+  ret i8 %3
+}
+
+define i8 @shared(i8 %a, i8 %b, i8 %c, i8* %p) {
+  %1 = xor i8 %a, %b
+  store i8 %1, i8* %p
+  %2 = xor i8 %1, %c
+  ret i8 %2
+}
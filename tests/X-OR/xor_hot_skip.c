@@ -0,0 +1,27 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-hot-threshold=4 -mllvm -obf-skip-hot %s -S -emit-llvm -O2 -o %t1.ll
+// The hot loop is left as is: no decoding anywhere
+// RUN: test `grep -c ' xor ' %t1.ll` -ge 1
+// RUN: test `grep -c ' udiv ' %t1.ll` = 0
+// Without -obf-skip-hot, the same loop is obfuscated with the cheapest base
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-hot-threshold=4 %s -S -emit-llvm -O2 -o %t4.ll
+// RUN: test `grep -c ' udiv ' %t4.ll` -gt 0
+// Function-level trees are skipped alike, and counted as hot
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-hot-threshold=4 -mllvm -obf-skip-hot -mllvm -xor-function-trees -mllvm -stats %s -S -emit-llvm -O2 -o %t5.ll 2> %t.stats
+// RUN: test `grep -c ' udiv ' %t5.ll` = 0
+// RUN: test `grep 'x-or - Number of hot trees made cheaper or skipped' %t.stats | awk '{print $1}'` -ge 1
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-hot-threshold=4 -mllvm -obf-skip-hot %s -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out 10` = `%t3.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]), b = 0xdeadbeef;
+    uint32_t h = 0;
+
+    for (uint32_t i = 0; i < a; ++i)
+        h = (h ^ b) ^ i;
+    printf("%u\n", h);
+    return 0;
+}
@@ -0,0 +1,20 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-native-base-ratio=0 %s -S -emit-llvm -O2 -o %t1.ll
+// RUN: test `grep -c ' xor ' %t1.ll` = 0
+// RUN: test `grep -c ' \(mul\|udiv\|urem\) i128 ' %t1.ll` = 0
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-native-base-ratio=0 %s -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out 10` = `%t3.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[]) {
+    volatile uint64_t a = atoi(argv[1]), b = 0xdeadbeefcafebabe, c = 42;
+    volatile unsigned __int128 d = a, e = ((unsigned __int128)b << 64) | c;
+
+    unsigned __int128 f = (d ^ e) ^ (e << 3);
+    printf("%llx\n", (unsigned long long)((a ^ b) ^ c));
+    printf("%llx%016llx\n", (unsigned long long)(f >> 64),
+           (unsigned long long)f);
+    return 0;
+}
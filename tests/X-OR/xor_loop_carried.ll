@@ -0,0 +1,25 @@
+;; RUN: opt -load LLVMX-OR.so -X-OR -xor-function-trees %s -S -o %t1.ll
+;; %h stays encoded across the 4 iterations and is decoded after the loop only
+;; RUN: test `grep -c ' xor ' %t1.ll` = 0
+;; RUN: test `grep -c ' udiv ' %t1.ll` = 7
+;; RUN: test `sed -n '/^exit:/,/^}/p' %t1.ll | grep -c ' udiv '` = 7
+;; The counter %i is a phi node without any xor: it makes no tree
+;; RUN: opt -load LLVMX-OR.so -X-OR -xor-function-trees -stats %s -S -o %t2.ll 2> %t.stats
+;; RUN: test `grep 'x-or - Number of trees found' %t.stats | awk '{print $1}'` = 1
+;; RUN: test `grep -c 'x-or - Number of trees without any eligible base' %t.stats` = 0
+
+define i8 @rounds(i8 %x, i8 %k) {
+entry:
+  br label %loop
+
+loop:
+  %h = phi i8 [ %x, %entry ], [ %h1, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i1, %loop ]
+  %h1 = xor i8 %h, %k
+  %i1 = add i32 %i, 1
+  %c = icmp ult i32 %i1, 4
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i8 %h1
+}
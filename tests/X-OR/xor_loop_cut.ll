@@ -0,0 +1,24 @@
+;; RUN: opt -load LLVMX-OR.so -X-OR -xor-function-trees %s -S -o %t1.ll
+;; Two xors into %h per iteration, over 16 iterations, would need a base above
+;; 32: %h is decoded and encoded again each iteration instead of staying
+;; encoded, and the xors of the loop are still replaced
+;; RUN: test `grep -c ' xor ' %t1.ll` = 0
+;; RUN: test `sed -n '/^loop:/,/^exit:/p' %t1.ll | grep -c ' udiv '` -gt 0
+;; RUN: test `grep -c ' phi ' %t1.ll` = 2
+
+define i8 @rounds(i8 %x, i8 %k, i8 %l) {
+entry:
+  br label %loop
+
+loop:
+  %h = phi i8 [ %x, %entry ], [ %h2, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i1, %loop ]
+  %h1 = xor i8 %h, %k
+  %h2 = xor i8 %h1, %l
+  %i1 = add i32 %i, 1
+  %c = icmp ult i32 %i1, 16
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i8 %h2
+}
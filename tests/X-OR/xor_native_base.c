@@ -0,0 +1,16 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-native-base-ratio=100 %s -S -emit-llvm -O2 -o %t1.ll
+// RUN: test `grep -c ' xor ' %t1.ll` = 0
+// RUN: test `grep -c ' i128 \| i96 ' %t1.ll` = 0
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-native-base-ratio=100 %s -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out 10` = `%t3.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]), b = 0xdeadbeef, c = 42;
+
+    printf("%u\n", (a ^ b) ^ c);
+    return 0;
+}
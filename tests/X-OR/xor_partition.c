@@ -0,0 +1,27 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so %s -S -emit-llvm -O2 -o %t1.ll
+// 41 leaves need a larger base than any allowed: the tree is cut
+// RUN: test `grep -c ' xor ' %t1.ll` = 0
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-max-limbs=1 %s -S -emit-llvm -O2 -o %t2.ll
+// RUN: test `grep -c ' xor ' %t2.ll` = 0
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so %s -O2 -o %t3.out
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-max-limbs=1 %s -O2 -o %t4.out
+// RUN: clang %s -O2 -o %t5.out
+// RUN: test `%t3.out 10` = `%t5.out 10`
+// RUN: test `%t4.out 10` = `%t5.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]), x[40];
+    for (unsigned i = 0; i < 40; ++i)
+        x[i] = i * 0x9e3779b9;
+
+    uint32_t r = a ^ x[0] ^ x[1] ^ x[2] ^ x[3] ^ x[4] ^ x[5] ^ x[6] ^ x[7]
+               ^ x[8] ^ x[9] ^ x[10] ^ x[11] ^ x[12] ^ x[13] ^ x[14] ^ x[15]
+               ^ x[16] ^ x[17] ^ x[18] ^ x[19] ^ x[20] ^ x[21] ^ x[22] ^ x[23]
+               ^ x[24] ^ x[25] ^ x[26] ^ x[27] ^ x[28] ^ x[29] ^ x[30] ^ x[31]
+               ^ x[32] ^ x[33] ^ x[34] ^ x[35] ^ x[36] ^ x[37] ^ x[38] ^ x[39];
+    printf("%u\n", r);
+    return 0;
+}
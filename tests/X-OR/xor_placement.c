@@ -0,0 +1,20 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-placement=last %s -S -emit-llvm -O2 -o %t1.ll
+// Nothing runs after the pass to fold the decodings back into xors
+// RUN: test `grep -c ' xor ' %t1.ll` = 0
+// RUN: test `grep -c ' udiv ' %t1.ll` -gt 0
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-placement=scalar-late %s -O2 -o %t2.out
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-placement=last %s -O2 -o %t3.out
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-placement=last %s -O0 -o %t4.out
+// RUN: clang %s -O2 -o %t5.out
+// RUN: test `%t2.out 10` = `%t5.out 10`
+// RUN: test `%t3.out 10` = `%t5.out 10`
+// RUN: test `%t4.out 10` = `%t5.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+    unsigned a = atoi(argv[1]), b = 0xcafe, c = 0xbeef;
+    unsigned d = (a ^ b) ^ (c ^ (a << 2));
+    printf("%u\n", d ^ 0x1234);
+    return 0;
+}
@@ -0,0 +1,40 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-seed=42 %s -S -emit-llvm -O2 -o %t1.ll
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-seed=42 %s -S -emit-llvm -O2 -o %t2.ll
+// RUN: cmp %t1.ll %t2.ll
+// Another seed makes other choices
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-seed=43 %s -S -emit-llvm -O2 -o %t3.ll
+// RUN: ! cmp -s %t1.ll %t3.ll
+// The choices made for @mix don't depend on the functions before it
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -obf-seed=42 -DEXTRA %s -S -emit-llvm -O2 -o %t4.ll
+// RUN: sed -n '/@mix(/,/^}/p' %t1.ll | sed 1d > %t1.mix
+// RUN: sed -n '/@mix(/,/^}/p' %t4.ll | sed 1d > %t4.mix
+// RUN: test -s %t1.mix
+// RUN: cmp %t1.mix %t4.mix
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef EXTRA
+uint32_t extra(uint32_t a, uint32_t b, uint32_t c) {
+    return ((a ^ b) ^ c) ^ (a ^ 0x1234);
+}
+#endif
+
+uint32_t mix(uint32_t a, uint32_t b, uint32_t c) {
+    return (a ^ b) ^ (c ^ 0xdeadbeef);
+}
+
+uint32_t fold(uint32_t a, uint32_t b) {
+    return ((a ^ (b << 1)) ^ (b ^ 0x5a5a)) ^ (a >> 3);
+}
+
+uint16_t narrow(uint16_t a, uint16_t b) {
+    return (a ^ b) ^ (uint16_t)(a << 2);
+}
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]), b = 0xdeadbeef, c = 42;
+
+    printf("%u %u %u\n", mix(a, b, c) ^ a, fold(a, b), narrow(a, c));
+    return 0;
+}
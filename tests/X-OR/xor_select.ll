@@ -0,0 +1,37 @@
+;; RUN: opt -load LLVMX-OR.so -X-OR %s -S -o %t1.ll
+;; @skipped opts out of X-OR through its "noobf" attribute
+;; RUN: test `sed -n '/@chain(/,/^}/p' %t1.ll | grep -c ' xor '` = 0
+;; RUN: test `sed -n '/@skipped(/,/^}/p' %t1.ll | grep -c ' xor '` = 2
+;; RUN: echo 'deny ch?in*  # only X-OR' > %t.list
+;; RUN: echo 'deny * split,zero' >> %t.list
+;; RUN: opt -load LLVMX-OR.so -X-OR -obf-list=%t.list %s -S -o %t2.ll
+;; RUN: test `grep -c ' xor ' %t2.ll` = 6
+;; An allow rule obfuscates nothing but the functions it matches
+;; RUN: echo 'allow chain_also xor' > %t2.list
+;; RUN: opt -load LLVMX-OR.so -X-OR -obf-list=%t2.list %s -S -o %t3.ll
+;; RUN: test `sed -n '/@chain(/,/^}/p' %t3.ll | grep -c ' xor '` = 2
+;; RUN: test `sed -n '/@chain_also(/,/^}/p' %t3.ll | grep -c ' xor '` = 0
+;; Allowing a function for another pass leaves X-OR as it is
+;; RUN: echo 'allow chain_also zero' > %t3.list
+;; RUN: opt -load LLVMX-OR.so -X-OR -obf-list=%t3.list %s -S -o %t4.ll
+;; RUN: test `grep -c ' xor ' %t4.ll` = 2
+
+define i8 @chain(i8 %a, i8 %b, i8 %c) {
+  %1 = xor i8 %a, %b
+  %2 = xor i8 %1, %c
+  ret i8 %2
+}
+
+define i8 @chain_also(i8 %a, i8 %b, i8 %c) {
+  %1 = xor i8 %a, %b
+  %2 = xor i8 %1, %c
+  ret i8 %2
+}
+
+define i8 @skipped(i8 %a, i8 %b, i8 %c) #0 {
+  %1 = xor i8 %a, %b
+  %2 = xor i8 %1, %c
+  ret i8 %2
+}
+
+attributes #0 = { "noobf"="xor" }
@@ -0,0 +1,19 @@
+;; RUN: opt -load LLVMX-OR.so -X-OR -stats %s -S -o %t1.ll 2> %t.stats
+;; Two trees, an i8 one encoding into a single limb and an i64 one which
+;; needs several
+;; RUN: test `grep 'x-or - Number of trees found' %t.stats | awk '{print $1}'` = 2
+;; RUN: test `grep 'x-or - Number of trees transformed' %t.stats | awk '{print $1}'` = 2
+;; RUN: test `grep 'x-or - Number of bases encoding into a single limb' %t.stats | awk '{print $1}'` = 1
+;; RUN: test `grep 'x-or - Number of bases encoding into several limbs' %t.stats | awk '{print $1}'` = 1
+;; RUN: test `grep -c 'x-or - Number of trees without any eligible base' %t.stats` = 0
+
+define i8 @narrow(i8 %a, i8 %b, i8 %c) {
+  %1 = xor i8 %a, %b
+  %2 = xor i8 %1, %c
+  ret i8 %2
+}
+
+define i64 @wide(i64 %a, i64 %b) {
+  %1 = xor i64 %a, %b
+  ret i64 %1
+}
@@ -0,0 +1,20 @@
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-table-bits=8 %s -S -emit-llvm -O2 -o %t1.ll
+// RUN: test `grep -c ' xor ' %t1.ll` = 0
+// RUN: test `grep -c '^@xor.table.* = private unnamed_addr constant \[256 x ' %t1.ll` -ge 1
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-table-bits=8 %s -O2 -o %t2.out
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-table-bits=4 -mllvm -xor-permute-tables=false %s -O2 -o %t3.out
+// RUN: clang %s -O2 -o %t4.out
+// RUN: test `%t2.out 10` = `%t4.out 10`
+// RUN: test `%t3.out 10` = `%t4.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]), b = 0xdeadbeef, c = 42;
+    volatile uint64_t d = a, e = 0xcafebabe12345678;
+
+    printf("%u\n", (a ^ b) ^ c);
+    printf("%llu\n", (unsigned long long)((d ^ e) ^ b));
+    return 0;
+}
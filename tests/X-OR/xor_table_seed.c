@@ -0,0 +1,31 @@
+// Every block is hot, so that every tree gets the smallest base: @extra and
+// @mix then read the same tables. Whichever function builds a table, the
+// choices made for @mix stay the same.
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-table-bits=8 -mllvm -obf-hot-threshold=1 -mllvm -obf-seed=42 %s -S -emit-llvm -O2 -o %t1.ll
+// RUN: clang -Xclang -load -Xclang LLVMX-OR.so -mllvm -xor-table-bits=8 -mllvm -obf-hot-threshold=1 -mllvm -obf-seed=42 -DEXTRA %s -S -emit-llvm -O2 -o %t2.ll
+// RUN: test `grep -c ' xor ' %t2.ll` = 0
+// Tables are numbered in the order they are built
+// RUN: sed -n '/@mix(/,/^}/p' %t1.ll | sed '1d; s/@xor\.table[0-9]*/@xor.table/g' > %t1.mix
+// RUN: sed -n '/@mix(/,/^}/p' %t2.ll | sed '1d; s/@xor\.table[0-9]*/@xor.table/g' > %t2.mix
+// RUN: test `grep -c '@xor.table' %t1.mix` -ge 1
+// RUN: cmp %t1.mix %t2.mix
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef EXTRA
+uint32_t extra(uint32_t a, uint32_t b, uint32_t c) {
+    return (a ^ c) ^ (b + c);
+}
+#endif
+
+uint32_t mix(uint32_t a, uint32_t b, uint32_t c) {
+    return (a ^ b) ^ c;
+}
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]), b = 0xdeadbeef, c = 42;
+
+    printf("%u\n", mix(a, b, c));
+    return 0;
+}
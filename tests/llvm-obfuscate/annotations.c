@@ -0,0 +1,37 @@
+// RUN: clang %s -c -emit-llvm -O1 -o %t.bc
+// Every partition sees the annotations of the whole module: @plain is left
+// out by the obf annotation of @protect, wherever each of them lands
+// RUN: llvm-obfuscate -j 2 -partitions 4 -passes=X-OR %t.bc -S -o %t1.ll
+// RUN: test `sed -n '/@protect(/,/^}/p' %t1.ll | grep -c ' xor '` = 0
+// RUN: test `sed -n '/@plain(/,/^}/p' %t1.ll | grep -c ' xor '` = 1
+// RUN: test `sed -n '/@skip(/,/^}/p' %t1.ll | grep -c ' xor '` = 1
+// RUN: test `grep -c '^@llvm.global.annotations = ' %t1.ll` = 1
+// @skip is left out by its noobf annotation
+// RUN: llvm-obfuscate -j 2 -partitions 4 -passes=SplitBitwiseOp %t.bc -S -o %t2.ll
+// RUN: test `sed -n '/@plain(/,/^}/p' %t2.ll | grep -c ' xor '` -gt 1
+// RUN: test `sed -n '/@skip(/,/^}/p' %t2.ll | grep -c ' xor '` = 1
+// RUN: clang %t2.ll -O2 -o %t3.out
+// RUN: clang %s -O2 -o %t4.out
+// RUN: test `%t3.out 10` = `%t4.out 10`
+#include <stdlib.h>
+#include <stdio.h>
+
+__attribute__((noinline, annotate("obf:xor")))
+unsigned protect(unsigned a, unsigned b) {
+    return a ^ b;
+}
+
+__attribute__((noinline)) unsigned plain(unsigned a, unsigned b) {
+    return a ^ b;
+}
+
+__attribute__((noinline, annotate("noobf")))
+unsigned skip(unsigned a, unsigned b) {
+    return a ^ b;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned a = atoi(argv[1]);
+    printf("%u %u %u\n", protect(a, 42), plain(a, 7), skip(a, 0xbeef));
+    return 0;
+}
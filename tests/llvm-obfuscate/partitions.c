@@ -0,0 +1,30 @@
+// RUN: clang %s -c -emit-llvm -o %t.bc
+// RUN: llvm-obfuscate -j 2 -partitions 3 %t.bc -o %t.obf.bc
+// RUN: clang %t.obf.bc -S -emit-llvm -O2 -o %t1.ll
+// RUN: test `grep -c ' xor ' %t1.ll` = 0
+// RUN: clang %t.obf.bc -O2 -o %t2.out
+// RUN: clang %s -O2 -o %t3.out
+// RUN: test `%t2.out 10` = `%t3.out 10`
+// Named metadata are linked once, not once per partition
+// RUN: llvm-obfuscate -j 2 -partitions 3 %t.bc -S -o %t4.ll
+// RUN: test `grep '^!llvm.ident = ' %t4.ll | grep -c ','` = 0
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+static uint32_t counter = 0;
+
+static uint32_t mix(uint32_t a, uint32_t b) {
+    ++counter;
+    return (a ^ b) ^ (a << 3);
+}
+
+uint32_t fold(uint32_t a) {
+    return mix(a, 0xdeadbeef) ^ counter;
+}
+
+int main(int argc, char *argv[]) {
+    volatile uint32_t a = atoi(argv[1]);
+    printf("%u\n", fold(a) ^ mix(a, 42));
+    return 0;
+}
@@ -0,0 +1,26 @@
+;; RUN: llvm-obfuscate -whole-program -export=kept -passes=X-OR %s -S -o %t1.ll
+;; @unused is removed before obfuscation, @kept stays external
+;; RUN: test `grep -c '@unused' %t1.ll` = 0
+;; RUN: test `grep -c 'define i32 @kept' %t1.ll` = 1
+;; RUN: test `grep -c 'define internal i32 @helper' %t1.ll` = 1
+;; RUN: test `grep -c ' xor ' %t1.ll` = 0
+
+define i32 @unused(i32 %a, i32 %b) {
+  %1 = xor i32 %a, %b
+  ret i32 %1
+}
+
+define i32 @helper(i32 %a, i32 %b) {
+  %1 = xor i32 %a, %b
+  ret i32 %1
+}
+
+define i32 @kept(i32 %a) {
+  %1 = xor i32 %a, 42
+  ret i32 %1
+}
+
+define i32 @main(i32 %argc, i8** %argv) {
+  %1 = call i32 @helper(i32 %argc, i32 7)
+  ret i32 %1
+}
@@ -0,0 +1,515 @@
+// llvm-obfuscate: runs the obfuscation passes on a bitcode file.
+//
+// Function definitions are split into partitions which are obfuscated in
+// parallel, each in its own LLVMContext, and linked back together afterwards.
+//
+// The pass manager of this LLVM has no link-time extension point, so the
+// passes can't be hooked into LTO. Instead, the linked bitcode of a program
+// (e.g. from llvm-link) goes through llvm-obfuscate -whole-program, which
+// internalizes it and removes dead code first, so that only code which
+// ends up in the program is obfuscated.
+//
+// Each partition is a module of its own for the passes, with its own
+// overhead budget (-obf-cycle-budget, -obf-size-budget): a partition may grow
+// by the given percentage of its own estimate. The program as a whole stays
+// within the budget, but a partition can't use what another one left, so
+// what is obfuscated depends on the number of partitions. -partitions 1
+// spends the budget over the whole program, as opt would.
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Pass.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/PassSupport.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input bitcode file>"),
+                                          cl::init("-"),
+                                          cl::value_desc("filename"));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write output as LLVM assembly"));
+
+static cl::list<std::string>
+    PassNames("passes", cl::CommaSeparated,
+              cl::desc("Obfuscation passes to run, in order (default: "
+                       "ObfuscateZero,X-OR,SplitBitwiseOp)"));
+
+static cl::opt<unsigned>
+    NumThreads("j", cl::desc("Number of worker threads (default: number of "
+                             "hardware threads)"),
+               cl::init(0));
+
+static cl::opt<unsigned>
+    NumPartitions("partitions",
+                  cl::desc("Number of function partitions (default: four "
+                           "per worker thread), each with its own overhead "
+                           "budget"),
+                  cl::init(0));
+
+static cl::opt<bool>
+    WholeProgram("whole-program",
+                 cl::desc("The input is a whole program: internalize every "
+                          "symbol except main and the -export ones, and "
+                          "remove dead globals before obfuscating"));
+
+static cl::list<std::string>
+    ExportList("export", cl::CommaSeparated,
+               cl::desc("Symbols kept external by -whole-program"));
+
+static cl::opt<bool> NoReport("no-report",
+                              cl::desc("Do not print the throughput report"));
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point Start) {
+    return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+size_t countInstructions(Function const &F) {
+    size_t Count = 0;
+    for (auto const &BB : F)
+        Count += BB.size();
+    return Count;
+}
+
+// Local symbols are promoted to hidden external ones while the module is
+// split, so that partitions can refer to each other's definitions. Their
+// original linkage is restored once the partitions are linked back.
+struct PromotedSymbol {
+    std::string Name;
+    GlobalValue::LinkageTypes Linkage;
+    GlobalValue::VisibilityTypes Visibility;
+    bool WasUnnamed;
+};
+
+void promoteLocalSymbol(GlobalValue &GV,
+                        std::vector<PromotedSymbol> &Promoted) {
+    const bool WasUnnamed = not GV.hasName();
+    if (not GV.hasLocalLinkage() and not WasUnnamed)
+        return;
+    if (WasUnnamed)
+        GV.setName("obf.anon");
+    Promoted.push_back(PromotedSymbol{GV.getName(), GV.getLinkage(),
+                                      GV.getVisibility(), WasUnnamed});
+    if (GV.hasLocalLinkage()) {
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+        GV.setVisibility(GlobalValue::HiddenVisibility);
+    }
+}
+
+// Greedy balancing of the function definitions, largest first, over
+// NbPartitions partitions. Aliased functions stay in partition 0 alongside
+// the aliases themselves.
+std::vector<std::vector<std::string>>
+partitionFunctions(Module &M, unsigned NbPartitions) {
+    std::vector<std::vector<std::string>> Partitions(NbPartitions);
+
+    std::set<Function const *> Aliased;
+    for (auto const &GA : M.getAliasList())
+        if (auto const *F =
+                dyn_cast<Function>(GA.getAliasee()->stripPointerCasts()))
+            Aliased.insert(F);
+
+    std::vector<std::pair<size_t, Function *>> Definitions;
+    for (auto &F : M)
+        if (not F.isDeclaration())
+            Definitions.emplace_back(countInstructions(F), &F);
+    std::stable_sort(Definitions.begin(), Definitions.end(),
+                     [](std::pair<size_t, Function *> const &L,
+                        std::pair<size_t, Function *> const &R) {
+                         return L.first > R.first;
+                     });
+
+    typedef std::pair<size_t, unsigned> Load_t;
+    std::priority_queue<Load_t, std::vector<Load_t>, std::greater<Load_t>>
+        Loads;
+    for (unsigned I = 0; I < NbPartitions; ++I)
+        Loads.emplace(0u, I);
+
+    for (auto const &Def : Definitions) {
+        if (Aliased.count(Def.second)) {
+            Partitions[0].push_back(Def.second->getName());
+            continue;
+        }
+        Load_t Lightest = Loads.top();
+        Loads.pop();
+        Partitions[Lightest.second].push_back(Def.second->getName());
+        Lightest.first += Def.first;
+        Loads.push(Lightest);
+    }
+    return Partitions;
+}
+
+// Global variables the entries of llvm.global.annotations refer to: the
+// annotation strings and the names of their files
+std::set<GlobalVariable *> annotationStrings(Module &M) {
+    std::set<GlobalVariable *> Strings;
+    GlobalVariable *Annotations = M.getNamedGlobal("llvm.global.annotations");
+    if (not Annotations or not Annotations->hasInitializer())
+        return Strings;
+    for (auto const &Entry : Annotations->getInitializer()->operands()) {
+        User const *Fields = cast<User>(Entry.get());
+        for (unsigned I = 1; I < Fields->getNumOperands(); ++I)
+            if (auto *GV = dyn_cast<GlobalVariable>(
+                    Fields->getOperand(I)->stripPointerCasts()))
+                Strings.insert(GV);
+    }
+    return Strings;
+}
+
+void makeDeclaration(GlobalVariable &GV) {
+    GV.setInitializer(nullptr);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setComdat(nullptr);
+}
+
+// Turns Src into partition Index: only the listed function definitions are
+// kept, and every other definition except for those of partition 0 is turned
+// into a declaration. Named metadata and the annotations, which select the
+// functions to obfuscate module-wide, stay until the partition is
+// obfuscated, see dropLinkedMetadata.
+void keepPartition(Module &Src, unsigned Index,
+                   std::vector<std::string> const &Functions) {
+    std::set<StringRef> Kept(Functions.begin(), Functions.end());
+
+    for (auto &F : Src)
+        if (not F.isDeclaration() and not Kept.count(F.getName())) {
+            F.deleteBody();
+            F.setComdat(nullptr);
+        }
+
+    if (Index == 0)
+        return;
+
+    // Global variables and aliases are defined once, in partition 0.
+    GlobalVariable *Annotations =
+        Src.getNamedGlobal("llvm.global.annotations");
+    const std::set<GlobalVariable *> Strings = annotationStrings(Src);
+    std::vector<GlobalVariable *> Appending;
+    for (auto GV = Src.global_begin(), E = Src.global_end(); GV != E; ++GV) {
+        if (&*GV == Annotations or Strings.count(&*GV))
+            continue;
+        if (GV->hasAppendingLinkage())
+            Appending.push_back(&*GV);
+        else if (not GV->isDeclaration())
+            makeDeclaration(*GV);
+    }
+    for (auto *GV : Appending)
+        GV->eraseFromParent();
+
+    std::vector<GlobalAlias *> Aliases;
+    for (auto &GA : Src.getAliasList())
+        Aliases.push_back(&GA);
+    for (auto *GA : Aliases) {
+        Type *Ty = GA->getType()->getElementType();
+        GlobalValue *Decl;
+        if (FunctionType *FTy = dyn_cast<FunctionType>(Ty))
+            Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "",
+                                    &Src);
+        else
+            Decl = new GlobalVariable(Src, Ty, false,
+                                      GlobalValue::ExternalLinkage, nullptr);
+        Decl->setVisibility(GA->getVisibility());
+        Decl->takeName(GA);
+        GA->replaceAllUsesWith(Decl);
+        GA->eraseFromParent();
+    }
+}
+
+// The linker appends the operands of named metadata, except for the module
+// flags which it merges, and the entries of llvm.global.annotations: once
+// obfuscated, partitions other than 0 drop them (debug info compile units,
+// identification...) so that the linked module has them once.
+void dropLinkedMetadata(Module &M) {
+    const std::set<GlobalVariable *> Strings = annotationStrings(M);
+    if (GlobalVariable *Annotations =
+            M.getNamedGlobal("llvm.global.annotations"))
+        Annotations->eraseFromParent();
+    for (auto *GV : Strings)
+        if (not GV->isDeclaration())
+            makeDeclaration(*GV);
+
+    std::vector<NamedMDNode *> NamedMDs;
+    for (auto &NMD : M.getNamedMDList())
+        if (NMD.getName() != "llvm.module.flags")
+            NamedMDs.push_back(&NMD);
+    for (auto *NMD : NamedMDs)
+        NMD->eraseFromParent();
+}
+
+std::unique_ptr<Module> parseBitcode(std::string const &Bitcode,
+                                     LLVMContext &Context,
+                                     std::string &ErrorMsg) {
+    std::unique_ptr<MemoryBuffer> Buffer(
+        MemoryBuffer::getMemBuffer(Bitcode, "", false));
+    ErrorOr<Module *> ModuleOrErr = parseBitcodeFile(Buffer.get(), Context);
+    if (std::error_code EC = ModuleOrErr.getError()) {
+        ErrorMsg = EC.message();
+        return nullptr;
+    }
+    return std::unique_ptr<Module>(ModuleOrErr.get());
+}
+
+std::string writeBitcode(Module const &M) {
+    std::string Bitcode;
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(&M, OS);
+    OS.flush();
+    return Bitcode;
+}
+
+struct PartitionResult {
+    std::string Bitcode;
+    std::string ErrorMsg;
+    size_t InstructionsBefore = 0, InstructionsAfter = 0;
+};
+
+void obfuscatePartition(std::string const &Bitcode, unsigned Index,
+                        std::vector<std::string> const &Functions,
+                        std::vector<PassInfo const *> const &Passes,
+                        PartitionResult &Result) {
+    LLVMContext Context;
+    std::unique_ptr<Module> M = parseBitcode(Bitcode, Context, Result.ErrorMsg);
+    if (not M)
+        return;
+
+    keepPartition(*M, Index, Functions);
+
+    legacy::FunctionPassManager FPM(M.get());
+    for (auto const *Info : Passes)
+        FPM.add(Info->createPass());
+
+    FPM.doInitialization();
+    for (auto &F : *M) {
+        if (F.isDeclaration())
+            continue;
+        Result.InstructionsBefore += countInstructions(F);
+        FPM.run(F);
+        Result.InstructionsAfter += countInstructions(F);
+    }
+    FPM.doFinalization();
+
+    if (Index != 0)
+        dropLinkedMetadata(*M);
+
+    Result.Bitcode = writeBitcode(*M);
+}
+}
+
+int main(int argc, char **argv) {
+    sys::PrintStackTraceOnErrorSignal();
+    PrettyStackTraceProgram X(argc, argv);
+    llvm_shutdown_obj Y;
+
+    // Analyses required by the passes (e.g. block frequencies)
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeAnalysis(Registry);
+    initializeIPA(Registry);
+    initializeTransformUtils(Registry);
+
+    cl::ParseCommandLineOptions(argc, argv, "obfuscation driver\n");
+
+    std::vector<std::string> Names(PassNames.begin(), PassNames.end());
+    if (Names.empty())
+        Names = {"ObfuscateZero", "X-OR", "SplitBitwiseOp"};
+
+    std::vector<PassInfo const *> Passes;
+    for (auto const &Name : Names) {
+        PassInfo const *Info = Registry.getPassInfo(Name);
+        if (not Info) {
+            errs() << argv[0] << ": unknown pass '" << Name << "'\n";
+            return 1;
+        }
+        Passes.push_back(Info);
+    }
+
+    const unsigned Threads =
+        NumThreads ? NumThreads
+                   : std::max(1u, std::thread::hardware_concurrency());
+
+    const auto Start = Clock::now();
+
+    // Loading
+    auto PhaseStart = Clock::now();
+    LLVMContext Context;
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M(ParseIRFile(InputFilename, Err, Context));
+    if (not M) {
+        Err.print(argv[0], errs());
+        return 1;
+    }
+    const double LoadTime = secondsSince(PhaseStart);
+
+    // Whole program optimization: dead code is not worth obfuscating
+    if (WholeProgram) {
+        std::vector<const char *> Exported{"main"};
+        for (auto const &Name : ExportList)
+            Exported.push_back(Name.c_str());
+        legacy::PassManager PM;
+        PM.add(createInternalizePass(Exported));
+        PM.add(createGlobalDCEPass());
+        PM.run(*M);
+    }
+
+    // Splitting
+    PhaseStart = Clock::now();
+    std::vector<PromotedSymbol> Promoted;
+    for (auto &F : *M)
+        promoteLocalSymbol(F, Promoted);
+    for (auto GV = M->global_begin(), E = M->global_end(); GV != E; ++GV)
+        promoteLocalSymbol(*GV, Promoted);
+    for (auto &GA : M->getAliasList())
+        promoteLocalSymbol(GA, Promoted);
+
+    size_t NbFunctions = 0;
+    for (auto const &F : *M)
+        NbFunctions += not F.isDeclaration();
+
+    const unsigned NbPartitions = std::max<size_t>(
+        1u, std::min<size_t>(NumPartitions ? NumPartitions : 4 * Threads,
+                             NbFunctions));
+    auto Partitions = partitionFunctions(*M, NbPartitions);
+
+    const std::string Bitcode = writeBitcode(*M);
+    M.reset();
+    const double SplitTime = secondsSince(PhaseStart);
+
+    // Obfuscating partitions on the thread pool
+    PhaseStart = Clock::now();
+    std::vector<PartitionResult> Results(NbPartitions);
+    std::atomic<unsigned> NextPartition(0u);
+    std::vector<std::thread> Pool;
+    for (unsigned I = 0; I < std::min(Threads, NbPartitions); ++I)
+        Pool.emplace_back([&]() {
+            for (unsigned Index = NextPartition++; Index < NbPartitions;
+                 Index = NextPartition++)
+                obfuscatePartition(Bitcode, Index, Partitions[Index], Passes,
+                                   Results[Index]);
+        });
+    for (auto &Worker : Pool)
+        Worker.join();
+    const double ObfuscationTime = secondsSince(PhaseStart);
+
+    // Linking partitions back together
+    PhaseStart = Clock::now();
+    std::unique_ptr<Module> Linked;
+    size_t InstructionsBefore = 0, InstructionsAfter = 0;
+    for (unsigned Index = 0; Index < NbPartitions; ++Index) {
+        PartitionResult &Result = Results[Index];
+        std::unique_ptr<Module> Partition;
+        if (Result.ErrorMsg.empty())
+            Partition = parseBitcode(Result.Bitcode, Context, Result.ErrorMsg);
+        if (not Partition) {
+            errs() << argv[0] << ": partition " << Index << ": "
+                   << Result.ErrorMsg << "\n";
+            return 1;
+        }
+        std::string().swap(Result.Bitcode);
+        InstructionsBefore += Result.InstructionsBefore;
+        InstructionsAfter += Result.InstructionsAfter;
+
+        if (not Linked) {
+            Linked = std::move(Partition);
+            continue;
+        }
+        std::string ErrorMsg;
+        if (Linker::LinkModules(Linked.get(), Partition.get(),
+                                Linker::DestroySource, &ErrorMsg)) {
+            errs() << argv[0] << ": linking partition " << Index << ": "
+                   << ErrorMsg << "\n";
+            return 1;
+        }
+    }
+
+    for (auto const &Symbol : Promoted) {
+        GlobalValue *GV = Linked->getNamedValue(Symbol.Name);
+        if (not GV)
+            continue;
+        GV->setLinkage(Symbol.Linkage);
+        GV->setVisibility(Symbol.Visibility);
+        if (Symbol.WasUnnamed)
+            GV->setName("");
+    }
+
+    if (verifyModule(*Linked, &errs())) {
+        errs() << argv[0] << ": linked module is broken\n";
+        return 1;
+    }
+    const double LinkTime = secondsSince(PhaseStart);
+
+    // Writing
+    PhaseStart = Clock::now();
+    std::string ErrorInfo;
+    tool_output_file Out(OutputFilename.c_str(), ErrorInfo, sys::fs::F_None);
+    if (not ErrorInfo.empty()) {
+        errs() << argv[0] << ": " << ErrorInfo << "\n";
+        return 1;
+    }
+    if (OutputAssembly)
+        Linked->print(Out.os(), nullptr);
+    else
+        WriteBitcodeToFile(Linked.get(), Out.os());
+    Out.keep();
+    const double WriteTime = secondsSince(PhaseStart);
+
+    const double TotalTime = secondsSince(Start);
+
+    if (not NoReport) {
+        const double MBytes = Bitcode.size() / (1024. * 1024.);
+        errs() << argv[0] << ": " << NbFunctions << " functions in "
+               << NbPartitions << " partitions on "
+               << std::min(Threads, NbPartitions) << " threads\n";
+        errs() << "  load       " << format("%8.3f", LoadTime) << " s\n"
+               << "  split      " << format("%8.3f", SplitTime) << " s\n"
+               << "  obfuscate  " << format("%8.3f", ObfuscationTime) << " s\n"
+               << "  link       " << format("%8.3f", LinkTime) << " s\n"
+               << "  write      " << format("%8.3f", WriteTime) << " s\n"
+               << "  total      " << format("%8.3f", TotalTime) << " s\n";
+        errs() << "  instructions " << InstructionsBefore << " -> "
+               << InstructionsAfter << "\n";
+        errs() << "  throughput " << format("%.1f", NbFunctions / TotalTime)
+               << " functions/s, " << format("%.2f", MBytes / TotalTime)
+               << " MB/s of input bitcode, "
+               << format("%.0f", InstructionsBefore / ObfuscationTime)
+               << " instructions/s obfuscated\n";
+    }
+    return 0;
+}